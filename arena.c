@@ -0,0 +1,186 @@
+/*****************************************************************************
+**
+**  Name:          arena.c
+**
+**  Description:   Fixed size memory arena.
+**
+******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define ARENA_ROUND(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+arena_t *
+arena_create(size_t size)
+{
+	arena_t *a;
+	void *mem;
+
+	size = ARENA_ROUND(sizeof(*a)) + ARENA_ROUND(size);
+
+	/* Populated up front: running out of RAM shows now, not mid-download */
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (mem == MAP_FAILED) {
+		return(NULL);
+	}
+
+	a = mem;
+	pthread_mutex_init(&a->lock, NULL);
+	a->base = (unsigned char *)mem + ARENA_ROUND(sizeof(*a));
+	a->size = size - ARENA_ROUND(sizeof(*a));
+	a->used = 0;
+	a->high = 0;
+	a->top = NULL;
+	a->failed = 0;
+
+	return(a);
+}
+
+void
+arena_destroy(arena_t *a)
+{
+	if (a == NULL) {
+		return;
+	}
+
+	pthread_mutex_destroy(&a->lock);
+	munmap(a, ARENA_ROUND(sizeof(*a)) + a->size);
+}
+
+/* Called with the lock held */
+static void *
+arena_take(arena_t *a, size_t len)
+{
+	void *p;
+
+	len = ARENA_ROUND(len ? len : 1);
+
+	if (len > a->size - a->used) {
+		a->failed++;
+		errno = ENOMEM;
+		return(NULL);
+	}
+
+	p = a->base + a->used;
+	a->used += len;
+	a->top = p;
+
+	if (a->used > a->high) {
+		a->high = a->used;
+	}
+
+	return(p);
+}
+
+void *
+arena_alloc(arena_t *a, size_t len)
+{
+	void *p;
+
+	if (a == NULL) {
+		return(calloc(1, len ? len : 1));
+	}
+
+	pthread_mutex_lock(&a->lock);
+	if ((p = arena_take(a, len)) != NULL) {
+		memset(p, 0, len);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return(p);
+}
+
+void *
+arena_realloc(arena_t *a, void *p, size_t old, size_t len)
+{
+	size_t start;
+	void *n;
+
+	if (a == NULL) {
+		return(realloc(p, len));
+	}
+
+	if (p == NULL) {
+		return(arena_alloc(a, len));
+	}
+
+	pthread_mutex_lock(&a->lock);
+
+	if (p == a->top) {
+		start = (unsigned char *)p - a->base;
+		if (ARENA_ROUND(len) > a->size - start) {
+			a->failed++;
+			pthread_mutex_unlock(&a->lock);
+			errno = ENOMEM;
+			return(NULL);
+		}
+
+		a->used = start + ARENA_ROUND(len);
+		if (a->used > a->high) {
+			a->high = a->used;
+		}
+		if (len > old) {
+			memset((unsigned char *)p + old, 0, len - old);
+		}
+		n = p;
+	} else if ((n = arena_take(a, len)) != NULL) {
+		memcpy(n, p, old < len ? old : len);
+		if (len > old) {
+			memset((unsigned char *)n + old, 0, len - old);
+		}
+	}
+
+	pthread_mutex_unlock(&a->lock);
+
+	return(n);
+}
+
+void
+arena_free(arena_t *a, void *p)
+{
+	if (a == NULL) {
+		free(p);
+		return;
+	}
+
+	if (p == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	if (p == a->top) {
+		a->used = (unsigned char *)p - a->base;
+		a->top = NULL;
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+size_t
+arena_used(arena_t *a)
+{
+	size_t n;
+
+	pthread_mutex_lock(&a->lock);
+	n = a->used;
+	pthread_mutex_unlock(&a->lock);
+
+	return(n);
+}
+
+size_t
+arena_high(arena_t *a)
+{
+	size_t n;
+
+	pthread_mutex_lock(&a->lock);
+	n = a->high;
+	pthread_mutex_unlock(&a->lock);
+
+	return(n);
+}
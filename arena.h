@@ -0,0 +1,57 @@
+/*****************************************************************************
+**
+**  Name:          arena.h
+**
+**  Description:   Fixed size memory arena.
+**
+**                 One block is mapped and touched when the arena is created;
+**                 everything allocated from it afterwards is carved out of
+**                 that block and never returned piecemeal, so the memory a
+**                 bring-up uses is decided once at startup and cannot grow
+**                 or fragment.  An allocation that does not fit fails
+**                 instead.  The high-water mark tells how much of the block
+**                 a board actually needs.
+**
+**                 Functions taking an arena_t fall back to malloc() and
+**                 free() when it is NULL.
+**
+******************************************************************************/
+
+#ifndef __ARENA__H__
+#define __ARENA__H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define ARENA_ALIGN		16
+
+typedef struct {
+	pthread_mutex_t lock;		/* the prefetch helper allocates too */
+	unsigned char *base;
+	size_t size;
+	size_t used;
+	size_t high;			/* most ever used */
+	void *top;			/* last allocation, can grow in place */
+	unsigned int failed;		/* allocations that did not fit */
+} arena_t;
+
+/* Map an arena of size bytes, NULL if the memory is not there */
+extern arena_t *arena_create(size_t size);
+extern void arena_destroy(arena_t *a);
+
+/* len zeroed bytes, NULL with ENOMEM when they do not fit */
+extern void *arena_alloc(arena_t *a, size_t len);
+
+/*
+ * Resize p, allocated with old bytes, to len bytes.  The last allocation
+ * grows in place, others are copied to a new block.
+ */
+extern void *arena_realloc(arena_t *a, void *p, size_t old, size_t len);
+
+/* Returns the last allocation to the arena, other blocks stay used */
+extern void arena_free(arena_t *a, void *p);
+
+extern size_t arena_used(arena_t *a);
+extern size_t arena_high(arena_t *a);
+
+#endif
@@ -0,0 +1,516 @@
+/*****************************************************************************
+**
+**  Name:          bench.c
+**
+**  Description:   Microbenchmarks of the bring-up's hot paths.
+**
+**                 It is invoked in the form
+**						bench [-t ms] [-f image] [name ...]
+**
+**                 and runs the named benchmarks, or all of them:
+**
+**                 hcd_record    HCD record iteration
+**                 h4_frame      H4 framing and write of a record
+**                 h4_event      read of a Command Complete event
+**                 baud_encode   BRCM_encode_baud_rate()
+**                 baud_check    validate_baudrate()
+**                 bdaddr        parsing a --bd_addr argument
+**                 log           log2file() of one line
+**                 log_off       log2file() with logging disabled
+**                 dump          patchram_dump() of a record, as -d does
+**                 dump_off      patchram_dump() with logging disabled
+**
+**                 Records come from a synthetic image of Write_RAM
+**                 records, or from image.  Frames are written to
+**                 /dev/null, events read back from a temporary file and
+**                 the log written to another one, so only the cost of
+**                 the code and its system calls is measured.
+**
+**                 Each benchmark runs for about ms milliseconds (200 by
+**                 default) and reports ns/op.  Its system calls are then
+**                 counted exactly by running some more operations in a
+**                 child traced with PTRACE_SYSCALL, which needs no code
+**                 specific to the architecture, so the numbers compare
+**                 between the build host and the cross-compiled target.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "hcd.h"
+#include "transport.h"
+#include "patchram.h"
+
+#define BENCH_RECORDS		256	/* in the synthetic image */
+#define BENCH_EVENTS		1024	/* in the event file */
+#define BENCH_COUNT_OPS		256	/* at most, run traced */
+#define BENCH_WARMUP_OPS	16
+
+#define HCI_WRITE_RAM		0xfc4c
+#define HCI_LAUNCH_RAM		0xfc4e
+
+typedef struct {
+	const char *name;
+	int (*setup)(void);
+	void (*op)(void);
+	void (*teardown)(void);
+} bench_t;
+
+static const char *image_path;
+static hcd_image_t image;
+static unsigned char *synthetic;
+static size_t image_off;
+static const unsigned char *record;
+static int record_len;
+
+static transport_t tp;
+static unsigned char pkt[TRANSPORT_PKT_LEN];
+static char log_name[] = "/tmp/bench_log.XXXXXX";
+static patchram_t pr;
+static volatile int sink;
+
+/* Write_RAM records filling 255 byte packets, then Launch_RAM */
+static int
+image_build(void)
+{
+	unsigned char *p;
+	unsigned long addr = 0x00085000;
+	int i, j;
+
+	image.len = BENCH_RECORDS * (HCD_RECORD_HDR_LEN + 255)
+		+ HCD_RECORD_HDR_LEN + 4;
+
+	if ((synthetic = malloc(image.len)) == NULL) {
+		return(-1);
+	}
+
+	for (i = 0, p = synthetic; i < BENCH_RECORDS; i++, addr += 251) {
+		*p++ = HCI_WRITE_RAM & 0xff;
+		*p++ = HCI_WRITE_RAM >> 8;
+		*p++ = 255;
+		for (j = 0; j < 4; j++) {
+			*p++ = addr >> (8 * j);
+		}
+		for (j = 0; j < 251; j++) {
+			*p++ = i + j;
+		}
+	}
+
+	*p++ = HCI_LAUNCH_RAM & 0xff;
+	*p++ = HCI_LAUNCH_RAM >> 8;
+	*p++ = 4;
+	memset(p, 0xff, 4);
+
+	strcpy(image.name, "SYNTHETIC");
+	strcpy(image.path, "synthetic");
+	image.data = synthetic;
+	image.type = HCD_RAW;
+	image.nrecords = hcd_validate(image.data, image.len);
+
+	return(0);
+}
+
+static int
+image_open(void)
+{
+	int len;
+
+	if (image_path == NULL) {
+		return(image_build());
+	}
+
+	if (hcd_map(image_path, &image) < 0) {
+		fprintf(stderr, "bench: can't map %s, error %d\n", image_path,
+			errno);
+		return(-1);
+	}
+
+	/* Inflate a compressed image completely before timing it */
+	hcd_start(&image);
+	while (hcd_next_record(&image, &image_off, &len) != NULL) {
+	}
+	image_off = 0;
+
+	return(0);
+}
+
+/* The next record, starting over at the end of the image */
+static void
+image_next(void)
+{
+	if ((record = hcd_next_record(&image, &image_off, &record_len))
+			== NULL) {
+		image_off = 0;
+		record = hcd_next_record(&image, &image_off, &record_len);
+	}
+}
+
+static void
+hcd_record_op(void)
+{
+	image_next();
+	sink += record_len;
+}
+
+static int
+h4_frame_setup(void)
+{
+	memset(&tp, 0, sizeof(tp));
+	tp.ops = &transport_socket;
+
+	if ((tp.fd = open("/dev/null", O_WRONLY)) < 0) {
+		return(-1);
+	}
+
+	return(0);
+}
+
+/* As the download hands a record over: type byte, then the record */
+static void
+h4_frame_op(void)
+{
+	static unsigned char type = 0x01;
+	struct iovec iov[2];
+
+	image_next();
+	iov[0].iov_base = &type;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void *)record;
+	iov[1].iov_len = record_len;
+
+	tp.ops->send(&tp, iov, 2);
+	sink += tp.ops->flush(&tp);
+}
+
+static void
+tp_close(void)
+{
+	close(tp.fd);
+}
+
+static int
+h4_event_setup(void)
+{
+	static const unsigned char evt[] = {
+		0x04, 0x0e, 0x04, 0x01, HCI_WRITE_RAM & 0xff, HCI_WRITE_RAM >> 8,
+		0x00
+	};
+	FILE *fp;
+	int i;
+
+	if ((fp = tmpfile()) == NULL) {
+		return(-1);
+	}
+
+	for (i = 0; i < BENCH_EVENTS; i++) {
+		fwrite(evt, 1, sizeof(evt), fp);
+	}
+
+	fflush(fp);
+	memset(&tp, 0, sizeof(tp));
+	tp.ops = &transport_socket;
+	tp.fd = dup(fileno(fp));
+	fclose(fp);
+
+	if (tp.fd < 0) {
+		return(-1);
+	}
+
+	lseek(tp.fd, 0, SEEK_SET);
+
+	return(0);
+}
+
+static void
+h4_event_op(void)
+{
+	int len = 0;
+
+	if (tp.ops->recv(&tp, pkt, &len, 0) < 0) {
+		lseek(tp.fd, 0, SEEK_SET);
+		len = 0;
+		tp.ops->recv(&tp, pkt, &len, 0);
+	}
+
+	sink += pkt[6];
+}
+
+static void
+baud_encode_op(void)
+{
+	unsigned char encoded[4];
+
+	BRCM_encode_baud_rate(3000000, encoded);
+	sink += encoded[2];
+}
+
+static void
+baud_check_op(void)
+{
+	int value;
+
+	sink += validate_baudrate(3000000, &value);
+}
+
+static int
+bdaddr_setup(void)
+{
+	patchram_init(&pr);
+	return(0);
+}
+
+static void
+bdaddr_op(void)
+{
+	sink += patchram_set_bdaddr(&pr, "43:29:B1:55:01:01");
+}
+
+static int
+log_setup(void)
+{
+	int fd;
+
+	if ((fd = mkstemp(log_name)) < 0) {
+		return(-1);
+	}
+
+	close(fd);
+	log2file_name = log_name;
+	log2file_enabled = 1;
+
+	return(0);
+}
+
+static int
+log_off_setup(void)
+{
+	if (log_setup() < 0) {
+		return(-1);
+	}
+
+	log2file_enabled = 0;
+
+	return(0);
+}
+
+static void
+log_op(void)
+{
+	log2file("FW path = %s\n", image.path);
+}
+
+static void
+dump_op(void)
+{
+	image_next();
+	patchram_dump(record, record_len);
+}
+
+static void
+log_close(void)
+{
+	unlink(log_name);
+	strcpy(log_name, "/tmp/bench_log.XXXXXX");
+	log2file_name = LOG_FILE_NAME;
+	log2file_enabled = 0;
+}
+
+static const bench_t benches[] = {
+	{ "hcd_record", NULL, hcd_record_op, NULL },
+	{ "h4_frame", h4_frame_setup, h4_frame_op, tp_close },
+	{ "h4_event", h4_event_setup, h4_event_op, tp_close },
+	{ "baud_encode", NULL, baud_encode_op, NULL },
+	{ "baud_check", NULL, baud_check_op, NULL },
+	{ "bdaddr", bdaddr_setup, bdaddr_op, NULL },
+	{ "log", log_setup, log_op, log_close },
+	{ "log_off", log_off_setup, log_op, log_close },
+	{ "dump", log_setup, dump_op, log_close },
+	{ "dump_off", log_off_setup, dump_op, log_close },
+	{ NULL, NULL, NULL, NULL }
+};
+
+static long long
+bench_ns(const bench_t *b, long n)
+{
+	struct timespec t0, t1;
+	long i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		b->op();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return((t1.tv_sec - t0.tv_sec) * 1000000000LL
+		+ (t1.tv_nsec - t0.tv_nsec));
+}
+
+/*
+ * System calls of n operations, run in a traced child between two
+ * SIGSTOPs it sends itself.  Every call stops the child on entry and on
+ * exit; the kill() of the second SIGSTOP is one of them.  Returns -1 when
+ * the child can't be traced.
+ */
+static long
+bench_syscalls(const bench_t *b, long n)
+{
+	int status, sig, marks = 0;
+	long i, stops = 0;
+	pid_t pid, self;
+
+	if ((pid = fork()) < 0) {
+		return(-1);
+	}
+
+	if (pid == 0) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+			_exit(1);
+		}
+		self = getpid();
+		kill(self, SIGSTOP);	/* for the tracer to set up */
+		kill(self, SIGSTOP);
+		for (i = 0; i < n; i++) {
+			b->op();
+		}
+		kill(self, SIGSTOP);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) {
+		return(-1);
+	}
+
+	ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)PTRACE_O_TRACESYSGOOD);
+	sig = 0;
+
+	while (marks < 2 && ptrace(PTRACE_SYSCALL, pid, NULL,
+			(void *)(long)sig) == 0
+			&& waitpid(pid, &status, 0) == pid && WIFSTOPPED(status)) {
+		sig = WSTOPSIG(status);
+
+		if (sig == (SIGTRAP | 0x80)) {
+			stops += marks;
+			sig = 0;
+		} else if (sig == SIGSTOP) {
+			marks++;
+			sig = 0;
+		}
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+
+	return(marks == 2 ? stops / 2 - 1 : -1);
+}
+
+static void
+bench_run(const bench_t *b, long long target_ns)
+{
+	long long ns;
+	long n, calls;
+
+	if (b->setup && b->setup() < 0) {
+		printf("%-12s setup failed, error %d\n", b->name, errno);
+		return;
+	}
+
+	/* Estimate the ops that take target_ns from a warm-up run */
+	ns = bench_ns(b, BENCH_WARMUP_OPS);
+	n = ns > 0 ? target_ns * BENCH_WARMUP_OPS / ns : 1000000;
+	if (n < BENCH_WARMUP_OPS) {
+		n = BENCH_WARMUP_OPS;
+	}
+
+	ns = bench_ns(b, n);
+	calls = bench_syscalls(b, n < BENCH_COUNT_OPS ? n : BENCH_COUNT_OPS);
+
+	if (calls < 0) {
+		printf("%-12s %12.1f %12s %10ld\n", b->name, (double)ns / n,
+			"-", n);
+	} else {
+		printf("%-12s %12.1f %12.2f %10ld\n", b->name, (double)ns / n,
+			(double)calls / (n < BENCH_COUNT_OPS ? n
+				: BENCH_COUNT_OPS), n);
+	}
+
+	if (b->teardown) {
+		b->teardown();
+	}
+}
+
+static void
+usage(void)
+{
+	const bench_t *b;
+
+	fprintf(stderr, "Usage: bench [-t ms] [-f image] [name ...]\n\n");
+	for (b = benches; b->name != NULL; b++) {
+		fprintf(stderr, "\t%s\n", b->name);
+	}
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const bench_t *b;
+	long long target_ns = 200 * 1000000LL;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "t:f:")) != -1) {
+		switch (c) {
+		case 't':
+			target_ns = atoll(optarg) * 1000000LL;
+			break;
+		case 'f':
+			image_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		for (b = benches; b->name != NULL; b++) {
+			if (strcmp(b->name, argv[i]) == 0) {
+				break;
+			}
+		}
+		if (b->name == NULL) {
+			usage();
+		}
+	}
+
+	/* Only the benchmarks write the log */
+	log2file_enabled = 0;
+
+	if (image_open() < 0) {
+		return(1);
+	}
+
+	printf("%-12s %12s %12s %10s\n", "benchmark", "ns/op", "syscalls/op",
+		"ops");
+
+	for (b = benches; b->name != NULL; b++) {
+		for (i = optind; i < argc; i++) {
+			if (strcmp(b->name, argv[i]) == 0) {
+				break;
+			}
+		}
+		if (optind == argc || i < argc) {
+			bench_run(b, target_ns);
+		}
+	}
+
+	return(0);
+}
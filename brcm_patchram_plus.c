@@ -81,8 +81,64 @@
 **                          do not generate these two bytes.>
 **						<--tosleep=number of microsseconds to sleep before
 **							patchram download begins.>
+**						<--fw_aliases alias_file>
+**
+**							Where alias_file holds one
+**							"reported_chip_id firmware_chip_id" pair
+**							per line and replaces the built-in AMPAK
+**							table.
+**
+**						<--fw_index cache_file> to choose where the
+**							index of the patchram folder is cached.
+**						<--fw_store store_dir> to take
+**							images from a firmware store
+**							(see fw_store.h) before the
+**							patchram folder.
+**						<--foreground> to stay in the foreground
+**							without forking, when started by a
+**							supervisor such as systemd.
+**						<--transport transport>
+**
+**							Where transport is h4 (the
+**							default), h5 for the three-wire
+**							UART protocol or socket for a
+**							controller emulator on a pty.
+**						<--io_uring> to write commands and
+**							read events through io_uring,
+**							falling back to poll() where
+**							the kernel has none.
+**						<--low_latency> to set the UART
+**							driver's low_latency flag and
+**							lowest RX FIFO trigger level,
+**							so events are not held back
+**							by driver timers.
+**						<--rt_priority priority> to run the
+**							download under SCHED_FIFO at
+**							priority, with all memory
+**							locked.
+**						<--rt_cpu cpu> to pin the bring-up
+**							to one CPU.
+**						<--dry-run chip_id> to print the
+**							command schedule and projected
+**							wire time of bringing up a
+**							controller reporting chip_id,
+**							without any device.
+**						<--latency cmd_us[,reset_us[,launch_us]]>
+**							for the controller latency the
+**							dry run assumes per command,
+**							for HCI_Reset and for the reset
+**							that boots the patchram.
+**						<--trace trace_file> to record
+**							every command and event with
+**							its time, for hci_replay to
+**							play the controller back.
+**
 **						uart_device_name
 **
+**							Or unix:socket_path to talk H4
+**							to a controller emulator
+**							listening on a Unix socket.
+**
 **                 For example:
 **
 **                 brcm_patchram_plus -d --patchram  \
@@ -91,6 +147,21 @@
 **                 It will return 0 for success and a number greater than 0
 **                 for any errors.
 **
+**                 Outside Android the program daemonizes, but the process
+**                 that was started only exits once the controller has been
+**                 patched (and attached with --enable_hci), with the
+**                 daemon's status as its exit code.  When NOTIFY_SOCKET
+**                 is set, READY=1 is also sent to it at that point.
+**
+**                 With --enable_hci the daemon then supervises the HCI
+**                 device and, when it disappears, re-patches and
+**                 re-attaches the controller from the firmware image and
+**                 settings it already holds, without restarting.
+**
+**                 The bring-up itself is done by libbrcmpatchram (see
+**                 patchram.h), which a Bluetooth daemon can link and run
+**                 from its own event loop instead of starting this program.
+**
 **                 For Android, this program invoked using a 
 **                 "system(2)" call from the beginning of the bt_enable
 **                 function inside the file 
@@ -124,6 +195,19 @@
 
 #include <string.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sched.h>
+
+#ifndef ANDROID
+#include <unistd.h>
+#include "daemonize.h"
+#endif
+
+#include "log.h"
+#include "patchram.h"
+#include "fw_embed.h"
 
 #ifdef ANDROID
 #include <cutils/properties.h>
@@ -137,112 +221,46 @@
 
 #endif //ANDROID
 
-#ifndef N_HCI
-#define N_HCI	15
+#ifndef AF_BLUETOOTH
+#define AF_BLUETOOTH		31
+#endif
+#define BTPROTO_HCI		1
+#define HCI_DEV_NONE		0xffff
+#define HCI_CHANNEL_CONTROL	3
+#define MGMT_EV_INDEX_REMOVED	0x0005
+#define MGMT_HDR_SIZE		6
+
+/* Period of the fallback HCIUARTGETDEVICE check while supervising */
+#define SUPERVISE_POLL_MS	1000
+
+/*
+ * Memory for the controller context, the folder index and the prefetched
+ * images, taken once at startup; the debug log reports how much of it a
+ * bring-up actually used.
+ */
+#ifndef PATCHRAM_ARENA_SIZE
+#define PATCHRAM_ARENA_SIZE	(128 * 1024)
 #endif
 
-#define HCIUARTSETPROTO		_IOW('U', 200, int)
-#define HCIUARTGETPROTO		_IOR('U', 201, int)
-#define HCIUARTGETDEVICE	_IOR('U', 202, int)
-
-#define HCI_UART_H4		0
-#define HCI_UART_BCSP	1
-#define HCI_UART_3WIRE	2
-#define HCI_UART_H4DS	3
-#define HCI_UART_LL		4
-#define LOCAL_NAME_BUFFER_LEN                   32
-#define HCI_EVT_CMD_CMPL_LOCAL_NAME_STRING      6
+struct sockaddr_hci {
+	sa_family_t hci_family;
+	unsigned short hci_dev;
+	unsigned short hci_channel;
+};
 typedef unsigned char uchar;
-/* AMPAK FW auto detection table */
-typedef struct {
-    char *chip_id;
-    char *updated_chip_id;
-} fw_auto_detection_entry_t;
-
-#define FW_TABLE_VERSION "v1.1 20161117"
-static const fw_auto_detection_entry_t fw_auto_detection_table[] = {
-    {"4343A0","BCM43438A0"},    //AP6212
-    {"BCM43430A1","BCM43438A1"}, //AP6212A
-    {"BCM20702A","BCM20710A1"}, //AP6210B
-    {"BCM4335C0","BCM4339A0"}, //AP6335
-    {"BCM4330B1","BCM40183B2"}, //AP6330
-    {"BCM4324B3","BCM43241B4"}, //AP62X2
-    {"BCM4350C0","BCM4354A1"}, //AP6354
-    {"BCM4354A2","BCM4356A2"}, //AP6356
-//    {"BCM4345C0","BCM4345C0"}, //AP6255
-//    {"BCM43341B0","BCM43341B0"}, //AP6234
-//    {"BCM2076B1","BCM2076B1"}, //AP6476
-	{"BCM43430B0","BCM4343B0"}, //AP6236
-	{"BCM4359C0","BCM4359C0"},	//AP6359
-	{"BCM4349B1","BCM4359B1"},	//AP6359
-    {(const char *) NULL, NULL}
-}; 
 int uart_fd = -1;
-int hcdfile_fd = -1;
-int termios_baudrate = 0;
-int bdaddr_flag = 0;
-int enable_lpm = 0;
+char *uart_path = NULL;
+arena_t *arena;
+patchram_t *patchram;
 int enable_hci = 0;
-int use_baudrate_for_download = 0;
 int debug = 0;
-int scopcm = 0;
-int i2s = 0;
-int no2bytes = 0;
-int tosleep = 0;
-
-struct termios termios;
-uchar buffer[1024];
-uchar local_name[LOCAL_NAME_BUFFER_LEN];
-uchar fw_folder_path[1024];
-
-uchar hci_reset[] = { 0x01, 0x03, 0x0c, 0x00 };
-
-uchar hci_read_local_name[] = { 0x01, 0x14, 0x0c, 0x00 };
-
-uchar hci_download_minidriver[] = { 0x01, 0x2e, 0xfc, 0x00 };
-
-uchar hci_update_baud_rate[] = { 0x01, 0x18, 0xfc, 0x06, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00 };
-
-uchar hci_write_bd_addr[] = { 0x01, 0x01, 0xfc, 0x06,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-
-uchar hci_write_sleep_mode[] = { 0x01, 0x27, 0xfc, 0x0c,
-	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00,
-	0x00, 0x00 };
-
-uchar hci_write_sco_pcm_int[] =
-	{ 0x01, 0x1C, 0xFC, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00 };
-
-uchar hci_write_pcm_data_format[] =
-	{ 0x01, 0x1e, 0xFC, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00 };
-
-uchar hci_write_i2spcm_interface_param[] =
-	{ 0x01, 0x6d, 0xFC, 0x04, 0x00, 0x00, 0x00, 0x00 };
-
-//{{ add by FriendlyARM
-static int _debug = 1;
-#define LOG_FILE_NAME "/tmp/brcm_patchram_plus.log"
-static void _log2file(const char* fmt, va_list vl)
-{
-        FILE* file_out;
-        file_out = fopen(LOG_FILE_NAME,"a+");
-        if (file_out == NULL) {
-                return;
-        }
-        vfprintf(file_out, fmt, vl);
-        fclose(file_out);
-}
-void log2file(const char *fmt, ...)
-{
-        if (_debug) {
-                va_list vl;
-                va_start(vl, fmt);
-                _log2file(fmt, vl);
-                va_end(vl);
-        }
-}
-//}}
+int foreground = 0;
+char *dry_run_chip = NULL;
+char *trace_path = NULL;
+FILE *trace_fp = NULL;
+struct timespec trace_t0;
+patchram_model_t model = { PATCHRAM_MODEL_CMD_US, PATCHRAM_MODEL_RESET_US,
+	PATCHRAM_MODEL_LAUNCH_US };
 
 int
 parse_patchram(char *optarg)
@@ -260,8 +278,8 @@ parse_patchram(char *optarg)
     if(len>0)
     {
         *p =0;
-        strcpy(fw_folder_path,optarg);
-        log2file(stderr,"FW folder path = %s\n", fw_folder_path);
+        snprintf(patchram->fw_folder, sizeof(patchram->fw_folder), "%s", optarg);
+        log2file("FW folder path = %s\n", patchram->fw_folder);
     }
 #if 0
 	char *p;
@@ -286,66 +304,11 @@ parse_patchram(char *optarg)
 	return(0);
 }
 
-void
-BRCM_encode_baud_rate(uint baud_rate, uchar *encoded_baud)
-{
-	if(baud_rate == 0 || encoded_baud == NULL) {
-		log2file("Baudrate not supported!");
-		return;
-	}
-
-	encoded_baud[3] = (uchar)(baud_rate >> 24);
-	encoded_baud[2] = (uchar)(baud_rate >> 16);
-	encoded_baud[1] = (uchar)(baud_rate >> 8);
-	encoded_baud[0] = (uchar)(baud_rate & 0xFF);
-}
-
-typedef struct {
-	int baud_rate;
-	int termios_value;
-} tBaudRates;
-
-tBaudRates baud_rates[] = {
-	{ 115200, B115200 },
-	{ 230400, B230400 },
-	{ 460800, B460800 },
-	{ 500000, B500000 },
-	{ 576000, B576000 },
-	{ 921600, B921600 },
-	{ 1000000, B1000000 },
-	{ 1152000, B1152000 },
-	{ 1500000, B1500000 },
-	{ 2000000, B2000000 },
-	{ 2500000, B2500000 },
-	{ 3000000, B3000000 },
-#ifndef __CYGWIN__
-	{ 3500000, B3500000 },
-	{ 4000000, B4000000 }
-#endif
-};
-
-int
-validate_baudrate(int baud_rate, int *value)
-{
-	unsigned int i;
-
-	for (i = 0; i < (sizeof(baud_rates) / sizeof(tBaudRates)); i++) {
-		if (baud_rates[i].baud_rate == baud_rate) {
-			*value = baud_rates[i].termios_value;
-			return(1);
-		}
-	}
-
-	return(0);
-}
-
 int
 parse_baudrate(char *optarg)
 {
-	int baudrate = atoi(optarg);
-
-	if (validate_baudrate(baudrate, &termios_baudrate)) {
-		BRCM_encode_baud_rate(baudrate, &hci_update_baud_rate[6]);
+	if (patchram_set_baudrate(patchram, atoi(optarg)) < 0) {
+		return(1);
 	}
 
 	return(0);
@@ -354,33 +317,24 @@ parse_baudrate(char *optarg)
 int
 parse_bdaddr(char *optarg)
 {
-	int bd_addr[6];
-	int i;
-
-	sscanf(optarg, "%02X:%02X:%02X:%02X:%02X:%02X",
-		&bd_addr[5], &bd_addr[4], &bd_addr[3],
-		&bd_addr[2], &bd_addr[1], &bd_addr[0]);
-
-	for (i = 0; i < 6; i++) {
-		hci_write_bd_addr[4 + i] = bd_addr[i];
+	if (patchram_set_bdaddr(patchram, optarg) < 0) {
+		return(1);
 	}
 
-	bdaddr_flag = 1;
-
 	return(0);
 }
 
 int
 parse_enable_lpm(char *optarg)
 {
-	enable_lpm = 1;
+	patchram->enable_lpm = 1;
 	return(0);
 }
 
 int
 parse_use_baudrate_for_download(char *optarg)
 {
-	use_baudrate_for_download = 1;
+	patchram->use_baudrate_for_download = 1;
 	return(0);
 }
 
@@ -406,14 +360,14 @@ parse_scopcm(char *optarg)
 		return(1);
 	}
 
-	scopcm = 1;
+	patchram->scopcm = 1;
 
 	for (i = 0; i < 5; i++) {
-		hci_write_sco_pcm_int[4 + i] = param[i];
+		patchram->sco_pcm_int[i] = param[i];
 	}
 
 	for (i = 0; i < 5; i++) {
-		hci_write_pcm_data_format[4 + i] = param[5 + i];
+		patchram->pcm_data_format[i] = param[5 + i];
 	}
 
 	return(0);
@@ -433,10 +387,10 @@ parse_i2s(char *optarg)
 		return(1);
 	}
 
-	i2s = 1;
+	patchram->i2s = 1;
 
 	for (i = 0; i < 4; i++) {
-		hci_write_i2spcm_interface_param[4 + i] = param[i];
+		patchram->i2spcm_param[i] = param[i];
 	}
 
 	return(0);
@@ -445,16 +399,122 @@ parse_i2s(char *optarg)
 int
 parse_no2bytes(char *optarg)
 {
-	no2bytes = 1;
+	patchram->no2bytes = 1;
 	return(0);
 }
 
 int
 parse_tosleep(char *optarg)
 {
-	tosleep = atoi(optarg);
+	patchram->tosleep = atoi(optarg);
 
-	if (tosleep <= 0) {
+	if (patchram->tosleep <= 0) {
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_foreground(char *optarg)
+{
+	foreground = 1;
+	return(0);
+}
+
+int
+parse_transport(char *optarg)
+{
+	if ((patchram->transport = transport_find(optarg)) == NULL) {
+		log2file("unknown transport %s\n", optarg);
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_io_uring(char *optarg)
+{
+	patchram->io_uring = 1;
+	return(0);
+}
+
+int
+parse_low_latency(char *optarg)
+{
+	patchram->low_latency = 1;
+	return(0);
+}
+
+int
+parse_fw_aliases(char *optarg)
+{
+	return((patchram->aliases = fw_alias_load(optarg)) == NULL);
+}
+
+int
+parse_fw_index(char *optarg)
+{
+	snprintf(patchram->fw_index_cache, sizeof(patchram->fw_index_cache), "%s",
+		optarg);
+	return(0);
+}
+
+int
+parse_fw_store(char *optarg)
+{
+	snprintf(patchram->fw_store, sizeof(patchram->fw_store), "%s", optarg);
+	log2file("FW store path = %s\n", patchram->fw_store);
+	return(0);
+}
+
+int
+parse_rt_priority(char *optarg)
+{
+	patchram->rt.priority = atoi(optarg);
+
+	if (patchram->rt.priority < sched_get_priority_min(SCHED_FIFO)
+			|| patchram->rt.priority
+				> sched_get_priority_max(SCHED_FIFO)) {
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_rt_cpu(char *optarg)
+{
+	patchram->rt.cpu = atoi(optarg);
+
+	if (patchram->rt.cpu < 0) {
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_dry_run(char *optarg)
+{
+	dry_run_chip = optarg;
+	return(0);
+}
+
+int
+parse_trace(char *optarg)
+{
+	trace_path = optarg;
+	return(0);
+}
+
+int
+parse_latency(char *optarg)
+{
+	if (sscanf(optarg, "%ld,%ld,%ld", &model.cmd_us, &model.reset_us,
+			&model.launch_us) < 1 || model.cmd_us < 0
+			|| model.reset_us < 0 || model.launch_us < 0) {
 		return(1);
 	}
 
@@ -503,7 +563,28 @@ usage(char *argv0)
 	log2file("\t\tbefore starting patchram download. Newer chips\n");
 	log2file("\t\tdo not generate these two bytes.>\n");
 	log2file("\t<--tosleep=microseconds>\n");
-	log2file("\tuart_device_name\n");
+	log2file("\t<--fw_aliases alias_file> - chip id alias rules\n");
+	log2file("\t\tused instead of the built-in AMPAK table\n");
+	log2file("\t<--fw_index cache_file> - where the patchram folder\n");
+	log2file("\t\tindex is cached, default %s\n", FW_INDEX_CACHE);
+	log2file("\t<--fw_store store_dir> - content-addressed FW store\n");
+	log2file("\t\tlooked up before the patchram folder\n");
+	log2file("\t<--foreground> - don't fork, for supervised startup\n");
+	log2file("\t<--transport h4|h5|socket> - HCI transport, default h4\n");
+	log2file("\t<--io_uring> - H4 I/O through io_uring when available\n");
+	log2file("\t<--low_latency> - tune the UART for event latency\n");
+	log2file("\t<--rt_priority priority> - download under SCHED_FIFO\n");
+	log2file("\t\tat priority, memory locked\n");
+	log2file("\t<--rt_cpu cpu> - pin the bring-up to cpu\n");
+	log2file("\t<--dry-run chip_id> - print the bring-up schedule\n");
+	log2file("\t\tand its projected time, no device needed\n");
+	log2file("\t<--latency cmd_us[,reset_us[,launch_us]]> - controller\n");
+	log2file("\t\tlatency for --dry-run, default %d,%d,%d\n",
+		PATCHRAM_MODEL_CMD_US, PATCHRAM_MODEL_RESET_US,
+		PATCHRAM_MODEL_LAUNCH_US);
+	log2file("\t<--trace trace_file> - record the HCI packets and\n");
+	log2file("\t\ttheir times, for hci_replay\n");
+	log2file("\tuart_device_name or unix:socket_path\n");
 }
 
 int
@@ -517,7 +598,11 @@ parse_cmd_line(int argc, char **argv)
 	PFI parse[] = { parse_patchram, parse_baudrate,
 		parse_bdaddr, parse_enable_lpm, parse_enable_hci,
 		parse_use_baudrate_for_download,
-		parse_scopcm, parse_i2s, parse_no2bytes, parse_tosleep};
+		parse_scopcm, parse_i2s, parse_no2bytes, parse_tosleep,
+		parse_fw_aliases, parse_fw_index, parse_fw_store,
+		parse_foreground, parse_transport, parse_io_uring,
+		parse_low_latency, parse_rt_priority, parse_rt_cpu,
+		parse_dry_run, parse_latency, parse_trace};
 
 	while (1) {
 		int this_option_optind = optind ? optind : 1;
@@ -534,6 +619,18 @@ parse_cmd_line(int argc, char **argv)
 			{"i2s", 1, 0, 0},
 			{"no2bytes", 0, 0, 0},
 			{"tosleep", 1, 0, 0},
+			{"fw_aliases", 1, 0, 0},
+			{"fw_index", 1, 0, 0},
+			{"fw_store", 1, 0, 0},
+			{"foreground", 0, 0, 0},
+			{"transport", 1, 0, 0},
+			{"io_uring", 0, 0, 0},
+			{"low_latency", 0, 0, 0},
+			{"rt_priority", 1, 0, 0},
+			{"rt_cpu", 1, 0, 0},
+			{"dry-run", 1, 0, 0},
+			{"latency", 1, 0, 0},
+			{"trace", 1, 0, 0},
 			{0, 0, 0, 0}
 		};
 
@@ -559,6 +656,7 @@ parse_cmd_line(int argc, char **argv)
 				break;
 			case 'd':
 				debug = 1;
+				patchram->debug = 1;
 				break;
 
 			case '?':
@@ -581,277 +679,361 @@ parse_cmd_line(int argc, char **argv)
 	if (optind < argc) {
 		if (debug)
 			log2file ("%s \n", argv[optind]);
-		if ((uart_fd = open(argv[optind], O_RDWR | O_NOCTTY)) == -1) {
-			log2file("port %s could not be opened, error %d\n",
-					argv[2], errno);
-		}
+		/* Opened by main() once the process is daemonized */
+		uart_path = argv[optind];
 	}
 
 	return(0);
 }
 
+/* Startup profile from exec to the first hci_reset write */
+#define STARTUP_MAX_MARKS	8
+struct timespec startup_ts[STARTUP_MAX_MARKS];
+const char *startup_step[STARTUP_MAX_MARKS];
+int startup_nmarks = 0;
+int startup_done = 0;
+
 void
-init_uart()
+startup_mark(const char *step)
 {
-	tcflush(uart_fd, TCIOFLUSH);
-	tcgetattr(uart_fd, &termios);
-
-#ifndef __CYGWIN__
-	cfmakeraw(&termios);
-#else
-	termios.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
-                | INLCR | IGNCR | ICRNL | IXON);
-	termios.c_oflag &= ~OPOST;
-	termios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-	termios.c_cflag &= ~(CSIZE | PARENB);
-	termios.c_cflag |= CS8;
-#endif
+	if (startup_done || startup_nmarks == STARTUP_MAX_MARKS) {
+		return;
+	}
 
-	termios.c_cflag |= CRTSCTS;
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcflush(uart_fd, TCIOFLUSH);
-	cfsetospeed(&termios, B115200);
-	cfsetispeed(&termios, B115200);
-	tcsetattr(uart_fd, TCSANOW, &termios);
+	clock_gettime(CLOCK_MONOTONIC, &startup_ts[startup_nmarks]);
+	startup_step[startup_nmarks++] = step;
 }
 
-void
-dump(uchar *out, int len)
+long
+startup_us(int from, int to)
 {
-	int i;
-
-	for (i = 0; i < len; i++) {
-		if (i && !(i % 16)) {
-			log2file("\n");
-		}
-
-		log2file("%02x ", out[i]);
-	}
-
-	log2file("\n");
+	return((startup_ts[to].tv_sec - startup_ts[from].tv_sec) * 1000000L
+		+ (startup_ts[to].tv_nsec - startup_ts[from].tv_nsec) / 1000);
 }
 
 void
-read_event(int fd, uchar *buffer)
+startup_report(patchram_t *pr, const char *step, void *arg)
 {
-	int i = 0;
-	int len = 3;
-	int count;
+	char line[256];
+	int i, n = 0;
 
-	while ((count = read(fd, &buffer[i], len)) < len) {
-		i += count;
-		len -= count;
+	if (startup_done) {
+		return;
 	}
 
-	i += count;
-	len = buffer[2];
+	startup_mark("hci_reset");
+	startup_done = 1;
 
-	while ((count = read(fd, &buffer[i], len)) < len) {
-		i += count;
-		len -= count;
+	if (!debug) {
+		return;
 	}
 
-	if (debug) {
-		count += i;
-
-		log2file("received %d\n", count);
-		dump(buffer, count);
+	for (i = 1; i < startup_nmarks && n < (int)sizeof(line); i++) {
+		n += snprintf(line + n, sizeof(line) - n, " %s +%ldus",
+			startup_step[i], startup_us(i - 1, i));
 	}
+
+	log2file("startup:%s, total %ldus\n", line,
+		startup_us(0, startup_nmarks - 1));
 }
 
 void
-hci_send_cmd(uchar *buf, int len)
+bringup_done(patchram_t *pr, int error, void *arg)
 {
-	if (debug) {
-		log2file("writing\n");
-		dump(buf, len);
+	const patchram_failure_t *f;
+	unsigned int i;
+
+	for (i = 0; debug && i < pr->stats.download_failures; i++) {
+		f = &pr->stats.failures[i];
+		log2file("download %u failed at %d baud: record %d, offset %lu, "
+			"opcode 0x%04x, reason %d, status 0x%02x\n", i + 1,
+			f->baudrate, f->record, f->offset, f->opcode,
+			f->reason, f->status);
 	}
 
-	write(uart_fd, buf, len);
-}
+	if (debug && !error) {
+		log2file("reset %ldus, download %ldus, events %ldus on "
+			"average, slowest %ldus\n",
+			pr->stats.reset_us, pr->stats.download_us,
+			pr->stats.events ? pr->stats.event_us / pr->stats.events
+				: 0, pr->stats.max_event_us);
+		log2file("download: %ldus runnable but not running, "
+			"%u preemptions%s\n", pr->rt.wait_us,
+			pr->rt.preemptions,
+			pr->rt.fifo ? ", SCHED_FIFO" : "");
+		log2file("arena: %lu of %lu bytes in use, high-water %lu\n",
+			(unsigned long)arena_used(arena),
+			(unsigned long)arena->size,
+			(unsigned long)arena_high(arena));
+	}
 
-void
-expired(int sig)
-{
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
-	alarm(4);
+	if (trace_fp != NULL) {
+		fflush(trace_fp);
+	}
 }
 
+/*
+ * One line per packet: us since the first one, '>' for a command and '<'
+ * for what the controller sent, then the bytes in hex.  Written through
+ * stdio and flushed when a bring-up ends, so tracing costs no system
+ * call per packet.
+ */
 void
-proc_reset()
+trace_packet(patchram_t *pr, int out, const struct iovec *iov, int n,
+	void *arg)
 {
-	signal(SIGALRM, expired);
-
-
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
+	static const char digits[] = "0123456789abcdef";
+	char line[4 * PATCHRAM_PKT_LEN], *p = line;
+	const unsigned char *b;
+	struct timespec now;
+	size_t j;
+	int i;
 
-	alarm(4);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (trace_t0.tv_sec == 0 && trace_t0.tv_nsec == 0) {
+		trace_t0 = now;
+	}
 
-	read_event(uart_fd, buffer);
+	for (i = 0; i < n; i++) {
+		b = iov[i].iov_base;
+		for (j = 0; j < iov[i].iov_len && p < line + sizeof(line) - 4;
+				j++) {
+			*p++ = ' ';
+			*p++ = digits[b[j] >> 4];
+			*p++ = digits[b[j] & 0x0f];
+		}
+	}
+	*p = 0;
 
-	alarm(0);
+	fprintf(trace_fp, "%ld %c%s\n",
+		(now.tv_sec - trace_t0.tv_sec) * 1000000L
+			+ (now.tv_nsec - trace_t0.tv_nsec) / 1000,
+		out ? '>' : '<', line);
 }
 
+/* Schedule totals of a step, in the order the steps come */
+#define PLAN_MAX_STEPS	16
+struct {
+	const char *step;
+	int commands;
+	long bytes;
+	long wire_us;
+	long wait_us;
+} plan_steps[PLAN_MAX_STEPS];
+int plan_nsteps = 0;
+
 void
-proc_read_local_name()
+plan_print(patchram_t *pr, const patchram_plan_cmd_t *cmd, void *arg)
 {
-    int i;
-    char *p_name;
-    hci_send_cmd(hci_read_local_name, sizeof(hci_read_local_name));
-    read_event(uart_fd, buffer);
-    p_name = &buffer[1+HCI_EVT_CMD_CMPL_LOCAL_NAME_STRING];
-    for (i=0; (i < LOCAL_NAME_BUFFER_LEN)||(*(p_name+i) != 0); i++)
-        *(p_name+i) = toupper(*(p_name+i));
-    strcpy(local_name,p_name);
-    log2file("chip id = %s\n", local_name);
-}
+	int i;
 
-void
-proc_open_patchram()
-{
-    char fw_path[1024];
-    char *p;
-    int i;
-    fw_auto_detection_entry_t *p_entry;
-    p_entry = (fw_auto_detection_entry_t *)fw_auto_detection_table;
-    while (p_entry->chip_id != NULL)
-    {
-    	log2file("%s %s\n", local_name, p_entry->chip_id);	
-        if (strstr(local_name, p_entry->chip_id)!=NULL)
-        {
-            strcpy(local_name,p_entry->updated_chip_id);
-            break;
-        }
-        p_entry++;
-    }
-    sprintf(fw_path,"%s/%s.hcd",fw_folder_path,local_name);
-	log2file("FW path = %s\n", fw_path);
-	if ((hcdfile_fd = open(fw_path, O_RDONLY)) == -1) {
-		log2file("file %s could not be opened, error %d\n", fw_path , errno);
-	}
-    p = local_name;
-	log2file("Retry lower case FW name\n");
-    for (i=0; (i < LOCAL_NAME_BUFFER_LEN)||(*(p+i) != 0); i++)
-        *(p+i) = tolower(*(p+i));
-    sprintf(fw_path,"%s/%s.hcd",fw_folder_path,local_name);
-	log2file("FW path = %s\n", fw_path);
-	if ((hcdfile_fd = open(fw_path, O_RDONLY)) == -1) {
-		log2file("file %s could not be opened, error %d\n", fw_path, errno);
-		exit(5);
+	printf("%-20s 0x%04x %5d %5d %8d %9ld %9ld\n", cmd->step,
+		cmd->opcode, cmd->tx_bytes, cmd->rx_bytes, cmd->baudrate,
+		cmd->wire_us, cmd->wait_us);
+
+	for (i = 0; i < plan_nsteps && plan_steps[i].step != cmd->step; i++)
+		;
+
+	if (i == PLAN_MAX_STEPS) {
+		return;
 	}
 
+	plan_nsteps += (i == plan_nsteps);
+	plan_steps[i].step = cmd->step;
+	plan_steps[i].commands += cmd->opcode != 0;
+	plan_steps[i].bytes += cmd->tx_bytes + cmd->rx_bytes;
+	plan_steps[i].wire_us += cmd->wire_us;
+	plan_steps[i].wait_us += cmd->wait_us;
 }
-void
-proc_patchram()
+
+/*
+ * Print what bringing up a controller that reports dry_run_chip would
+ * take, with the settings given, and exit as the bring-up would.
+ */
+int
+dry_run()
 {
-	int len;
+	long total, wire = 0;
+	int i;
 
-	hci_send_cmd(hci_download_minidriver, sizeof(hci_download_minidriver));
+	patchram->cb.step = NULL;
+	patchram->cb.done = NULL;
+	patchram->cb.plan = plan_print;
 
-	read_event(uart_fd, buffer);
+	printf("%-20s %6s %5s %5s %8s %9s %9s\n", "step", "opcode", "tx",
+		"rx", "baud", "wire_us", "wait_us");
 
-	if (!no2bytes) {
-		read(uart_fd, &buffer[0], 2);
+	if ((total = patchram_plan(patchram, dry_run_chip, &model)) < 0) {
+		printf("no FW found for %s in %s\n", dry_run_chip,
+			patchram->fw_folder);
+		return(patchram->error == ENOENT ? 5 : 7);
 	}
 
-	if (tosleep) {
-		usleep(tosleep);
+	printf("\nchip %s, FW %s over %s, latency %ld,%ld,%ldus\n",
+		patchram->chip_id, patchram->image->path,
+		patchram->transport->name, model.cmd_us, model.reset_us,
+		model.launch_us);
+
+	for (i = 0; i < plan_nsteps; i++) {
+		printf("%-20s %4d commands %7ld bytes %9ldus wire %9ldus wait\n",
+			plan_steps[i].step, plan_steps[i].commands,
+			plan_steps[i].bytes, plan_steps[i].wire_us,
+			plan_steps[i].wait_us);
+		wire += plan_steps[i].wire_us;
 	}
 
-	while (read(hcdfile_fd, &buffer[1], 3)) {
-		buffer[0] = 0x01;
-
-		len = buffer[3];
-
-		read(hcdfile_fd, &buffer[4], len);
+	printf("projected total %ldus: %u commands, %lu bytes out, %lu in, "
+		"%ldus on the wire\n", total, patchram->stats.commands,
+		patchram->stats.tx_bytes, patchram->stats.rx_bytes, wire);
 
-		hci_send_cmd(buffer, len + 4);
+	return(0);
+}
 
-		read_event(uart_fd, buffer);
+/*
+ * Patch and configure the controller.  Once the firmware image is known,
+ * later bring-ups (re-patches) reuse the chip ID and image.
+ */
+int
+bringup()
+{
+	if (patchram_run(patchram, uart_fd) < 0) {
+		log2file("bring-up failed, error %d\n", patchram->error);
+		return(-1);
 	}
 
-	if (use_baudrate_for_download) {
-		cfsetospeed(&termios, B115200);
-		cfsetispeed(&termios, B115200);
-		tcsetattr(uart_fd, TCSANOW, &termios);
-	}
-	proc_reset();
+	return(0);
 }
 
-void
-proc_baudrate()
+int
+mgmt_open()
 {
-	hci_send_cmd(hci_update_baud_rate, sizeof(hci_update_baud_rate));
+	struct sockaddr_hci addr;
+	int fd;
 
-	read_event(uart_fd, buffer);
+	fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+	if (fd < 0) {
+		return(-1);
+	}
 
-	cfsetospeed(&termios, termios_baudrate);
-	cfsetispeed(&termios, termios_baudrate);
-	tcsetattr(uart_fd, TCSANOW, &termios);
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = HCI_DEV_NONE;
+	addr.hci_channel = HCI_CHANNEL_CONTROL;
 
-	if (debug) {
-		log2file("Done setting baudrate\n");
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return(-1);
 	}
+
+	return(fd);
 }
 
-void
-proc_bdaddr()
+/* Consume pending management events, returns 1 if dev was removed */
+int
+mgmt_index_removed(int fd, int dev)
 {
-	hci_send_cmd(hci_write_bd_addr, sizeof(hci_write_bd_addr));
+	uchar ev[512];
+	int removed = 0;
+	ssize_t n;
+
+	while ((n = recv(fd, ev, sizeof(ev), MSG_DONTWAIT)) >= MGMT_HDR_SIZE) {
+		if ((ev[0] | ev[1] << 8) == MGMT_EV_INDEX_REMOVED
+				&& (ev[2] | ev[3] << 8) == dev) {
+			removed = 1;
+		}
+	}
 
-	read_event(uart_fd, buffer);
+	return(removed);
 }
 
-void
-proc_enable_lpm()
+/* Open the UART, or connect to an emulator given as unix:socket_path */
+int
+uart_open()
 {
-	hci_send_cmd(hci_write_sleep_mode, sizeof(hci_write_sleep_mode));
+	if (strncmp(uart_path, "unix:", 5) == 0) {
+		patchram->transport = &transport_socket;
+		return(transport_connect(uart_path + 5));
+	}
 
-	read_event(uart_fd, buffer);
+	return(open(uart_path, O_RDWR | O_NOCTTY));
 }
 
-void
-proc_scopcm()
+/* Detach the controller, re-patch it from warm state and attach it again */
+int
+recover()
 {
-	hci_send_cmd(hci_write_sco_pcm_int,
-		sizeof(hci_write_sco_pcm_int));
-
-	read_event(uart_fd, buffer);
+	int ldisc = N_TTY;
+
+	if (ioctl(uart_fd, TIOCSETD, &ldisc) < 0) {
+		/* The tty itself went away, start over on a fresh one */
+		close(uart_fd);
+		if ((uart_fd = uart_open()) == -1) {
+			log2file("port %s could not be reopened, error %d\n",
+					uart_path, errno);
+			return(-1);
+		}
+	}
 
-	hci_send_cmd(hci_write_pcm_data_format,
-		sizeof(hci_write_pcm_data_format));
+	if (bringup() < 0) {
+		return(-1);
+	}
 
-	read_event(uart_fd, buffer);
+	return(patchram_enable_hci(patchram));
 }
 
+/*
+ * Watch the attached controller and re-patch it whenever its HCI device
+ * goes away, instead of sleeping forever to hold the line discipline.
+ */
 void
-proc_i2s()
+supervise()
 {
-	hci_send_cmd(hci_write_i2spcm_interface_param,
-		sizeof(hci_write_i2spcm_interface_param));
+	struct pollfd p[2];
+	int dev, mgmt, lost;
 
-	read_event(uart_fd, buffer);
-}
+	dev = ioctl(uart_fd, HCIUARTGETDEVICE, 0);
+	mgmt = mgmt_open();
+	log2file("supervising hci%d%s\n", dev,
+		mgmt < 0 ? " without management socket" : "");
 
-void
-proc_enable_hci()
-{
-	int i = N_HCI;
-	int proto = HCI_UART_H4;
-	if (ioctl(uart_fd, TIOCSETD, &i) < 0) {
-		log2file("Can't set line discipline\n");
-		return;
-	}
+	while (1) {
+		p[0].fd = uart_fd;
+		p[0].events = 0;
+		p[1].fd = mgmt;
+		p[1].events = POLLIN;
 
-	if (ioctl(uart_fd, HCIUARTSETPROTO, proto) < 0) {
-		log2file("Can't set hci protocol\n");
-		return;
+		if (poll(p, mgmt < 0 ? 1 : 2, SUPERVISE_POLL_MS) < 0) {
+			continue;
+		}
+
+		lost = (p[0].revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+
+		if (mgmt >= 0 && (p[1].revents & POLLIN)) {
+			lost |= mgmt_index_removed(mgmt, dev);
+		}
+
+		if (ioctl(uart_fd, HCIUARTGETDEVICE, 0) != dev) {
+			lost = 1;
+		}
+
+		if (!lost) {
+			continue;
+		}
+
+		log2file("hci%d lost, re-patching controller\n", dev);
+
+		while (recover() < 0) {
+			sleep(1);
+		}
+
+		dev = ioctl(uart_fd, HCIUARTGETDEVICE, 0);
+		log2file("controller re-attached as hci%d\n", dev);
+
+		/* Forget the removal our own re-attach caused */
+		if (mgmt >= 0) {
+			mgmt_index_removed(mgmt, dev);
+		}
 	}
-	log2file("Done setting line discpline\n");
-	return;
 }
 
 #ifdef ANDROID
@@ -902,67 +1084,91 @@ read_default_bdaddr()
 int
 main (int argc, char **argv)
 {
+	int fd;
+
+	startup_mark("exec");
+
+	/* Everything the bring-up needs is taken from here, up front */
+	if ((arena = arena_create(PATCHRAM_ARENA_SIZE)) == NULL
+			|| (patchram = patchram_create(arena)) == NULL) {
+		log2file("no memory for a %d byte arena\n", PATCHRAM_ARENA_SIZE);
+		exit(1);
+	}
+
+	patchram->cb.step = startup_report;
+	patchram->cb.done = bringup_done;
+
 #ifdef ANDROID
 	read_default_bdaddr();
-#else
-    if (isAlreadyRunning() == 1) {
-        exit(3);
-    }
-    daemonize( "brcm_patchram_plus" );
 #endif
-	log2file("###AMPAK FW Auto detection patch version = [%s]###\n", FW_TABLE_VERSION);
 	if (parse_cmd_line(argc, argv)) {
 		exit(1);
 	}
 
-	if (uart_fd < 0) {
-		exit(2);
-	}
-
-	init_uart();
-
-	proc_reset();
+	startup_mark("parse");
 
-    proc_read_local_name();
+	if (dry_run_chip != NULL) {
+		exit(dry_run());
+	}
 
-    proc_open_patchram();
+#ifndef ANDROID
+	daemonize("brcm_patchram_plus", foreground);
+	startup_mark("daemonize");
 
-	if (use_baudrate_for_download) {
-		if (termios_baudrate) {
-			proc_baudrate();
-		}
+	/* Only now, so the lock survives the daemon's descriptor cleanup */
+	if (isAlreadyRunning() == 1) {
+		exit(3);
 	}
-
-	if (hcdfile_fd > 0) {
-		proc_patchram();
+	startup_mark("lock");
+#endif
+	/*
+	 * Opened here, the daemon's descriptor cleanup would close it.  The
+	 * daemon runs with umask 0, so the mode is given explicitly.
+	 */
+	if (trace_path != NULL) {
+		if ((fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC,
+				0600)) < 0 || fchmod(fd, 0600) < 0
+				|| (trace_fp = fdopen(fd, "w")) == NULL) {
+			log2file("can't write trace %s, error %d\n",
+				trace_path, errno);
+			if (fd >= 0) {
+				close(fd);
+			}
+		} else {
+			fprintf(trace_fp, "# us dir bytes\n");
+			patchram->cb.packet = trace_packet;
+		}
 	}
 
-	if (termios_baudrate) {
-		proc_baudrate();
-	}
+	log2file("###AMPAK FW Auto detection patch version = [%s]###\n", FW_TABLE_VERSION);
+	log2file("%d built-in FW images\n", fw_embed_count());
 
-	if (bdaddr_flag) {
-		proc_bdaddr();
+	if (uart_path != NULL && (uart_fd = uart_open()) == -1) {
+		log2file("port %s could not be opened, error %d\n",
+				uart_path, errno);
 	}
 
-	if (enable_lpm) {
-		proc_enable_lpm();
+	if (uart_fd < 0) {
+		exit(2);
 	}
 
-	if (scopcm) {
-		proc_scopcm();
-	}
+	startup_mark("open");
 
-	if (i2s) {
-		proc_i2s();
+	if (bringup() < 0) {
+		exit(patchram->error == ENOENT ? 5 : 7);
 	}
 
 	if (enable_hci) {
-		proc_enable_hci();
-
-		while (1) {
-			sleep(UINT_MAX);
+		if (patchram_enable_hci(patchram) < 0) {
+			exit(6);
 		}
+
+#ifndef ANDROID
+		/* The controller is usable, let the parent and init go on */
+		daemonize_ready(0);
+#endif
+
+		supervise();
 	}
 	exit(0);
 }
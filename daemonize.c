@@ -30,8 +30,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
-#include <syslog.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
 #include <sys/resource.h>
 #include <limits.h>
 #include <signal.h>
@@ -39,28 +40,96 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "daemonize.h"
 extern void log2file(const char *fmt, ...);
 
+/* 守护进程向等待中的父进程报告状态所用的管道写端 */
+static int ready_fd = -1;
+static int ready_sent = 0;
+
+static void daemonize_exit(int status, void *arg);
+
+/*
+ * Name: close_fds
+ *
+ * Purpose: 关闭除keep以外所有打开的文件描述符
+ *
+ * Params:
+ *          [1]keep: 需要保留的文件描述符, -1表示不保留
+ *
+ * Return: None
+ *
+ * Note: 优先使用close_range(), 其次遍历/proc/self/fd, 只有两者都不可用时
+ *       才逐个关闭到RLIMIT_NOFILE为止
+ */
+
+static void close_fds(int keep)
+{
+    struct rlimit rl;
+    struct dirent *de;
+    DIR *dir;
+    int i, fd;
+
+#ifdef SYS_close_range
+    if (keep < 0) {
+        if (syscall(SYS_close_range, 0, ~0U, 0) == 0) {
+            return;
+        }
+    } else if ((keep == 0 || syscall(SYS_close_range, 0, keep - 1, 0) == 0)
+            && syscall(SYS_close_range, keep + 1, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+
+    if ((dir = opendir("/proc/self/fd")) != NULL) {
+        while ((de = readdir(dir)) != NULL) {
+            fd = atoi(de->d_name);
+            if (de->d_name[0] != '.' && fd != keep && fd != dirfd(dir)) {
+                close(fd);
+            }
+        }
+        closedir(dir);
+        return;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_max == RLIM_INFINITY) {
+        rl.rlim_max = 1024;
+    }
+
+    for (i = 0; (unsigned int)i < rl.rlim_max; i++) {
+        if (i != keep) {
+            close(i);
+        }
+    }
+}
+
+
 /*
  * Name: daemonize
  *
  * Purpose: 将应用程序作为守护进程运行 
  *
  * Params:
- *          [1]cmd: 传入程序的名称，用于syslog
+ *          [1]cmd: 传入程序的名称，用于日志
+ *          [2]foreground: 非0时不fork, 供systemd等监管环境使用
  *
  * Return: None
  *
- * Note: None
+ * Note: 只fork一次; 之后打开的tty都使用O_NOCTTY, 所以不需要第二次fork
+ *       来防止重新获得控制终端
  */
 
-void daemonize(const char *cmd)
+void daemonize(const char *cmd, int foreground)
 {
-    int i, fd0, fd1, fd2;
+    int fd0, fd1, fd2;
+    int pfd[2];
+    ssize_t n;
+    char st;
     pid_t pid;
-    struct rlimit rl;
     struct sigaction sa;
 
     /*
@@ -68,11 +137,22 @@ void daemonize(const char *cmd)
      */
     umask(0);
 
+    /* Exiting before daemonize_ready() passes the exit status on */
+    on_exit(daemonize_exit, NULL);
+
     /*
-     * Get maximum number of file descriptors.
+     * A supervisor already gave us a session and sane descriptors.
      */
-    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
-        log2file("%s: can't get file limit\n", cmd);
+    if (foreground) {
+        return;
+    }
+
+    /*
+     * The parent stays until the daemon reports readiness and exits
+     * with its status, so init does not start dependents too early.
+     */
+    if (pipe(pfd) < 0) {
+        log2file("%s: can't create ready pipe\n", cmd);
         exit(1);
     }
 
@@ -83,48 +163,38 @@ void daemonize(const char *cmd)
         log2file("%s: can't fork\n", cmd);
         exit(1);
     } else if (pid != 0) /* parent */ {
-        exit(0);
+        close(pfd[1]);
+        while ((n = read(pfd[0], &st, 1)) < 0 && errno == EINTR)
+            ;
+        _exit(n == 1 ? st : 1);
     }
+
+    close(pfd[0]);
+    ready_fd = pfd[1];
     
     setsid();
 
-    /*
-     * Ensure future opens won't allocate controlling TTYs.
-     */
     sa.sa_handler = SIG_IGN;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     if (sigaction(SIGHUP, &sa, NULL) < 0) {
-        log2file("%s: can't ignore SIGHUP\n");
+        log2file("%s: can't ignore SIGHUP\n", cmd);
         exit(1);
     }
-    
-    if ((pid = fork()) < 0) {
-        log2file("%s: can't fork\n", cmd);
-        exit(1);
-    } else if (pid != 0) /* parent */ {
-        exit(0);
-    }
 
     /*
      * Change the current working directory to the root so
      * we won't prevent file systems from being unmounted.
      */
     if (chdir("/") < 0) {
-        log2file("%s: can't change directory to /\n");
+        log2file("%s: can't change directory to /\n", cmd);
         exit(1);
     }
 
     /*
      * Close all open file descriptors.
      */
-    if (rl.rlim_max == RLIM_INFINITY) {
-        rl.rlim_max = 1024;
-    }
-    
-    for (i = 0; (unsigned int)i < rl.rlim_max; i++) {
-        close(i);
-    }
+    close_fds(ready_fd);
 
     /*
      * Attach file descriptors 0, 1, and 2 to /dev/null.
@@ -133,10 +203,6 @@ void daemonize(const char *cmd)
     fd1 = dup(0);
     fd2 = dup(0);
 
-    /*
-     * Initialize the log file.
-     */
-    openlog(cmd, LOG_CONS, LOG_DAEMON);
     if (fd0 != 0 || fd1 != 1 || fd2 != 2) {
         log2file("unexpected file descriptors\n");
         exit(1);
@@ -144,6 +210,96 @@ void daemonize(const char *cmd)
 }
 
 
+/*
+ * Name: notify_socket
+ *
+ * Purpose: 按sd_notify协议向$NOTIFY_SOCKET发送状态
+ *
+ * Params:
+ *          [1]msg: 以换行分隔的状态字符串, 如"READY=1"
+ *
+ * Return: None
+ *
+ * Note: 未设置NOTIFY_SOCKET时什么也不做
+ */
+
+static void notify_socket(const char *msg)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un sa;
+    socklen_t len;
+    int fd;
+
+    if (path == NULL || (path[0] != '/' && path[0] != '@')
+            || strlen(path) >= sizeof(sa.sun_path)) {
+        return;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path, strlen(path));
+    if (path[0] == '@') {
+        sa.sun_path[0] = 0; /* abstract namespace */
+    }
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        return;
+    }
+
+    if (sendto(fd, msg, strlen(msg), MSG_NOSIGNAL,
+            (struct sockaddr *)&sa, len) < 0) {
+        log2file("can't notify %s: %s\n", path, strerror(errno));
+    }
+    close(fd);
+}
+
+
+/*
+ * Name: daemonize_ready
+ *
+ * Purpose: 通知父进程和init系统服务已就绪或启动失败
+ *
+ * Params:
+ *          [1]status: 0表示就绪, 否则为失败时的退出码
+ *
+ * Return: None
+ *
+ * Note: 只有第一次调用有效, 父进程以status作为自己的退出码退出
+ */
+
+void daemonize_ready(int status)
+{
+    char msg[64];
+    char st = status;
+
+    if (ready_sent) {
+        return;
+    }
+    ready_sent = 1;
+
+    if (status == 0) {
+        snprintf(msg, sizeof(msg), "READY=1\nMAINPID=%ld\n", (long)getpid());
+    } else {
+        snprintf(msg, sizeof(msg), "STATUS=bring-up failed with status %d\n",
+                status);
+    }
+    notify_socket(msg);
+
+    if (ready_fd >= 0) {
+        while (write(ready_fd, &st, 1) < 0 && errno == EINTR)
+            ;
+        close(ready_fd);
+        ready_fd = -1;
+    }
+}
+
+static void daemonize_exit(int status, void *arg)
+{
+    daemonize_ready(status);
+}
+
+
 /*
  * Name: lockfile
  *
@@ -203,7 +359,7 @@ int isAlreadyRunning()
        exit(1);
    }
    ftruncate(fd, 0);
-   sprintf(buf, "%ld", (long)getpid());
+   snprintf(buf, sizeof(buf), "%ld", (long)getpid());
    write(fd, buf, strlen(buf)+1);
    return (0);
 }
@@ -36,8 +36,11 @@
 /* 判断守护进程是否已经有一个实例在运行 */
 extern int isAlreadyRunning();
 
-/* 将应用程序作为守护进程运行 */
-extern void daemonize(const char *cmd);
+/* 将应用程序作为守护进程运行, foreground非0时留在前台 */
+extern void daemonize(const char *cmd, int foreground);
+
+/* 通知父进程和init系统(NOTIFY_SOCKET)服务已就绪, status非0表示失败 */
+extern void daemonize_ready(int status);
 
 #endif
 
@@ -0,0 +1,228 @@
+/*****************************************************************************
+**
+**  Name:          fw_alias.c
+**
+**  Description:   AMPAK FW auto detection rules.
+**
+**                 The built-in rules are generated from fw_aliases.txt into
+**                 a minimal perfect hash; rules loaded from an alias file
+**                 get the same kind of table at load time.  A reported
+**                 name is looked up one key length at a time, longest
+**                 first, so the longest matching rule always wins.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fw_alias.h"
+#include "fw_phash.h"
+
+extern void log2file(const char *fmt, ...);
+
+#define FW_ALIAS_ID_LEN		32
+
+typedef struct {
+	const char *key;		/* upper case, without "BCM" */
+	const char *updated_chip_id;
+} fw_alias_rule_t;
+
+#include "fw_alias_table.h"
+
+struct fw_alias_set {
+	int n;
+	const fw_alias_rule_t *rules;	/* in slot order */
+	const unsigned short *disp;
+	const unsigned char *key_lens;
+	void *ids;			/* storage of a loaded set's strings */
+};
+
+static const fw_alias_set_t builtin_set = {
+	FW_ALIAS_NRULES, fw_alias_rules, fw_alias_disp, fw_alias_key_lens, NULL
+};
+
+static int
+fw_alias_read(FILE *fp, char (**ids)[2][FW_ALIAS_ID_LEN])
+{
+	char line[256], (*r)[2][FW_ALIAS_ID_LEN], id[FW_ALIAS_ID_LEN], *p;
+	int n = 0, cap = 0;
+
+	*ids = NULL;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((p = strchr(line, '#')) != NULL) {
+			*p = 0;
+		}
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			if ((r = realloc(*ids, cap * sizeof(*r))) == NULL) {
+				break;
+			}
+			*ids = r;
+		}
+
+		r = &(*ids)[n];
+		if (sscanf(line, "%31s %31s", id, (*r)[1]) == 2) {
+			fw_phash_chip_key(id, (*r)[0], FW_ALIAS_ID_LEN);
+			n++;
+		}
+	}
+
+	return(n);
+}
+
+fw_alias_set_t *
+fw_alias_load(const char *path)
+{
+	char (*ids)[2][FW_ALIAS_ID_LEN];
+	fw_alias_set_t *set = NULL;
+	unsigned short *disp = NULL;
+	fw_alias_rule_t *rules = NULL;
+	unsigned char *lens = NULL;
+	const char **keys = NULL;
+	int *slot = NULL;
+	int n, i, j, l, nlens = 0;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		log2file("alias file %s could not be opened\n", path);
+		return(NULL);
+	}
+
+	n = fw_alias_read(fp, &ids);
+	fclose(fp);
+
+	if (n > 0) {
+		keys = malloc(n * sizeof(*keys));
+		slot = malloc(n * sizeof(*slot));
+		rules = malloc(n * sizeof(*rules));
+		disp = malloc(fw_phash_nbuckets(n) * sizeof(*disp));
+		lens = malloc(FW_ALIAS_ID_LEN);
+		set = malloc(sizeof(*set));
+	}
+
+	if (n <= 0 || !keys || !slot || !rules || !disp || !lens || !set) {
+		goto fail;
+	}
+
+	for (i = 0; i < n; i++) {
+		keys[i] = ids[i][0];
+
+		for (j = 0; j < i; j++) {
+			if (strcmp(keys[i], keys[j]) == 0) {
+				log2file("alias file %s: duplicate key %s\n", path,
+					keys[i]);
+				goto fail_quiet;
+			}
+		}
+	}
+
+	if (fw_phash_build(keys, n, disp, slot) < 0) {
+		goto fail;
+	}
+
+	for (i = 0; i < n; i++) {
+		rules[slot[i]].key = ids[i][0];
+		rules[slot[i]].updated_chip_id = ids[i][1];
+	}
+
+	for (l = FW_ALIAS_ID_LEN - 1; l > 0; l--) {
+		for (i = 0; i < n && strlen(keys[i]) != (size_t)l; i++)
+			;
+		if (i < n) {
+			lens[nlens++] = l;
+		}
+	}
+	lens[nlens] = 0;
+
+	free(keys);
+	free(slot);
+
+	set->n = n;
+	set->rules = rules;
+	set->disp = disp;
+	set->key_lens = lens;
+	set->ids = ids;
+
+	log2file("%d alias rules loaded from %s\n", n, path);
+
+	return(set);
+
+fail:
+	log2file("alias file %s has no usable rules\n", path);
+fail_quiet:
+	free(ids);
+	free(keys);
+	free(slot);
+	free(rules);
+	free(disp);
+	free(lens);
+	free(set);
+
+	return(NULL);
+}
+
+void
+fw_alias_free(fw_alias_set_t *set)
+{
+	if (set == NULL) {
+		return;
+	}
+
+	free((void *)set->rules);
+	free((void *)set->disp);
+	free((void *)set->key_lens);
+	free(set->ids);
+	free(set);
+}
+
+static const fw_alias_rule_t *
+fw_alias_match(const fw_alias_set_t *set, const char *key)
+{
+	const fw_alias_rule_t *r;
+	const unsigned char *l;
+	int klen = strlen(key);
+
+	for (l = set->key_lens; *l; l++) {
+		if (*l > klen) {
+			continue;
+		}
+
+		r = &set->rules[fw_phash_slot(set->disp, set->n, key, *l)];
+
+		if (strlen(r->key) == *l && memcmp(r->key, key, *l) == 0) {
+			return(r);
+		}
+	}
+
+	return(NULL);
+}
+
+int
+fw_alias_resolve(const fw_alias_set_t *set, char *name, int len)
+{
+	char key[FW_ALIAS_ID_LEN];
+	const fw_alias_rule_t *r;
+	const char *p = name;
+
+	if (set == NULL) {
+		set = &builtin_set;
+	}
+
+	/* Try each word of the reported name in turn */
+	while (*(p += strspn(p, " \t")) != 0) {
+		fw_phash_chip_key(p, key, sizeof(key));
+
+		if ((r = fw_alias_match(set, key)) != NULL) {
+			log2file("%s matches %s\n", name, r->key);
+			snprintf(name, len, "%s", r->updated_chip_id);
+			return(1);
+		}
+
+		p += strcspn(p, " \t");
+	}
+
+	return(0);
+}
@@ -0,0 +1,33 @@
+/*****************************************************************************
+**
+**  Name:          fw_alias.h
+**
+**  Description:   Chip name to firmware name alias rules.
+**
+**                 AMPAK modules report a chip name that differs from the
+**                 name of the HCD file they need.  The rules come from the
+**                 compiled-in table or, when given, from an alias file with
+**                 one "<reported chip id> <firmware chip id>" pair per line.
+**
+******************************************************************************/
+
+#ifndef __FW_ALIAS__H__
+#define __FW_ALIAS__H__
+
+#define FW_TABLE_VERSION "v1.1 20161117"
+
+typedef struct fw_alias_set fw_alias_set_t;
+
+/* Load the rules in path to use instead of the compiled-in ones */
+extern fw_alias_set_t *fw_alias_load(const char *path);
+
+extern void fw_alias_free(fw_alias_set_t *set);
+
+/*
+ * Rewrite name (a buffer of size len) to the firmware chip id it maps to
+ * in set, or in the compiled-in rules when set is NULL.  Returns 1 if a
+ * rule matched, 0 otherwise.
+ */
+extern int fw_alias_resolve(const fw_alias_set_t *set, char *name, int len);
+
+#endif
@@ -0,0 +1,245 @@
+/*****************************************************************************
+**
+**  Name:          fw_alias_test.c
+**
+**  Description:   Build host check of the alias rules, run by make test.
+**
+**                 It is invoked in the form
+**						fw_alias_test fw_aliases.txt
+**
+**                 Every rule of the file is resolved, as the bare chip id
+**                 and as a longer reported name, through the compiled-in
+**                 table and through the same file loaded at runtime, and
+**                 the result is compared with a plain scan of the rules
+**                 for the longest matching prefix.  The rules are then
+**                 loaded again with a shorter rule added under each key,
+**                 which must never win over the key's own rule, and a
+**                 file with a duplicate key must be refused.
+**
+**                 The exit status is 1 if any name resolved wrongly.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fw_alias.h"
+#include "fw_phash.h"
+
+#define MAX_RULES	256
+#define ID_LEN		32
+#define SHORTER_ID	"BCMSHORTER"
+
+typedef struct {
+	char key[ID_LEN];		/* upper case, without "BCM" */
+	char updated_chip_id[ID_LEN];
+} rule_t;
+
+static rule_t rules[2 * MAX_RULES];
+static int nrules;
+static int failed;
+
+/* The library logs through the daemon's log2file() */
+void
+log2file(const char *fmt, ...)
+{
+}
+
+static int
+read_rules(const char *path)
+{
+	char line[256], id[ID_LEN], *p;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return(-1);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL && nrules < MAX_RULES) {
+		if ((p = strchr(line, '#')) != NULL) {
+			*p = 0;
+		}
+
+		if (sscanf(line, "%31s %31s", id,
+				rules[nrules].updated_chip_id) == 2) {
+			fw_phash_chip_key(id, rules[nrules].key, ID_LEN);
+			nrules++;
+		}
+	}
+
+	fclose(fp);
+
+	return(nrules);
+}
+
+static int
+find_rule(const char *key)
+{
+	int i;
+
+	for (i = 0; i < nrules && strcmp(rules[i].key, key) != 0; i++)
+		;
+
+	return(i < nrules ? i : -1);
+}
+
+/* What name must resolve to: the longest rule key it starts with */
+static const char *
+expected(const char *name)
+{
+	char key[ID_LEN];
+	size_t len, best = 0;
+	const char *id = NULL;
+	int i;
+
+	fw_phash_chip_key(name, key, sizeof(key));
+
+	for (i = 0; i < nrules; i++) {
+		len = strlen(rules[i].key);
+		if (len > best && strncmp(rules[i].key, key, len) == 0) {
+			best = len;
+			id = rules[i].updated_chip_id;
+		}
+	}
+
+	return(id);
+}
+
+static void
+check(const fw_alias_set_t *set, const char *what, const char *name)
+{
+	const char *want = expected(name);
+	char buf[ID_LEN * 2];
+	int matched;
+
+	snprintf(buf, sizeof(buf), "%s", name);
+	matched = fw_alias_resolve(set, buf, sizeof(buf));
+
+	if (matched != (want != NULL)
+			|| (want != NULL && strcmp(buf, want) != 0)) {
+		printf("FAIL %s: %s resolved to %s, expected %s\n", what, name,
+			matched ? buf : "nothing", want ? want : "nothing");
+		failed++;
+	}
+}
+
+/* Each key as reported, lower case, and followed by more of the name */
+static void
+check_all(const fw_alias_set_t *set, const char *what, int n)
+{
+	char name[ID_LEN * 2];
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "BCM%s", rules[i].key);
+		check(set, what, name);
+		check(set, what, rules[i].key);
+
+		snprintf(name, sizeof(name), "BCM%s1 26MHz", rules[i].key);
+		check(set, what, name);
+
+		snprintf(name, sizeof(name), "bcm%s", rules[i].key);
+		for (j = 0; name[j]; j++) {
+			if (name[j] >= 'A' && name[j] <= 'Z') {
+				name[j] += 'a' - 'A';
+			}
+		}
+		check(set, what, name);
+	}
+}
+
+/* The file's rules plus one rule, a character shorter, under each key */
+static int
+write_shorter(const char *path, int n)
+{
+	char key[ID_LEN];
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		return(-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%s\t%s\n", rules[i].key, rules[i].updated_chip_id);
+
+		snprintf(key, sizeof(key), "%s", rules[i].key);
+		key[strlen(key) - 1] = 0;
+		if (key[0] != 0 && find_rule(key) < 0 && nrules < 2 * MAX_RULES) {
+			fprintf(fp, "%s\t%s\n", key, SHORTER_ID);
+			snprintf(rules[nrules].key, ID_LEN, "%s", key);
+			snprintf(rules[nrules].updated_chip_id, ID_LEN, "%s",
+				SHORTER_ID);
+			nrules++;
+		}
+	}
+
+	return(fclose(fp));
+}
+
+int
+main(int argc, char **argv)
+{
+	char tmp[] = "/tmp/fw_alias_test.XXXXXX";
+	fw_alias_set_t *set;
+	FILE *fp;
+	int n, fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: fw_alias_test fw_aliases.txt\n");
+		return(2);
+	}
+
+	if ((n = read_rules(argv[1])) <= 0) {
+		fprintf(stderr, "fw_alias_test: no rules in %s\n", argv[1]);
+		return(2);
+	}
+
+	check_all(NULL, "built-in", n);
+
+	if ((set = fw_alias_load(argv[1])) == NULL) {
+		printf("FAIL %s could not be loaded\n", argv[1]);
+		return(1);
+	}
+	check_all(set, "loaded", n);
+	fw_alias_free(set);
+
+	if ((fd = mkstemp(tmp)) < 0) {
+		fprintf(stderr, "fw_alias_test: no temporary file\n");
+		return(2);
+	}
+	close(fd);
+
+	if (write_shorter(tmp, n) < 0 || (set = fw_alias_load(tmp)) == NULL) {
+		printf("FAIL rules with shorter prefixes could not be loaded\n");
+		unlink(tmp);
+		return(1);
+	}
+	unlink(tmp);
+
+	check_all(set, "shorter prefixes", nrules);
+	fw_alias_free(set);
+
+	/* The same key twice is an error, as it is for gen_fw_alias */
+	strcpy(tmp, "/tmp/fw_alias_test.XXXXXX");
+	if ((fd = mkstemp(tmp)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		fprintf(stderr, "fw_alias_test: no temporary file\n");
+		return(2);
+	}
+	fprintf(fp, "%s\t%s\n%s\t%s\n", rules[0].key, rules[0].updated_chip_id,
+		rules[0].key, SHORTER_ID);
+	fclose(fp);
+
+	if ((set = fw_alias_load(tmp)) != NULL) {
+		printf("FAIL rules with a duplicate key were loaded\n");
+		fw_alias_free(set);
+		failed++;
+	}
+	unlink(tmp);
+
+	printf("%d rules, %d names resolved wrongly\n", n, failed);
+
+	return(failed ? 1 : 0);
+}
@@ -0,0 +1,69 @@
+/*****************************************************************************
+**
+**  Name:          fw_chip.c
+**
+**  Description:   LMP subversion to chip id table.
+**
+**                 Matches are exact: a subversion either names one chip
+**                 or none, so modules sharing a name prefix can't get
+**                 each other's firmware.
+**
+******************************************************************************/
+
+#include <string.h>
+#include <strings.h>
+
+#include "fw_chip.h"
+
+typedef struct {
+	unsigned short lmp_subver;
+	const char *name;
+} fw_chip_entry_t;
+
+static const fw_chip_entry_t fw_chips[] = {
+	{ 0x2122, "BCM4343A0" },
+	{ 0x2209, "BCM43430A1" },
+	{ 0x6119, "BCM4345C0" },
+	{ 0x230f, "BCM4356A2" },
+	{ 0x4103, "BCM4330B1" },
+	{ 0x410e, "BCM43341B0" },
+	{ 0x4406, "BCM4324B3" },
+	{ 0x6109, "BCM4335C0" },
+	{ 0x220e, "BCM20702A1" },
+	{ 0x6106, "BCM4359C0" },
+	{ 0x410c, "BCM43430B0" },
+};
+
+#define FW_NCHIPS	(sizeof(fw_chips) / sizeof(fw_chips[0]))
+
+const char *
+fw_chip_name(const fw_chip_version_t *v)
+{
+	unsigned int i;
+
+	if (v->manufacturer != FW_CHIP_BROADCOM) {
+		return(NULL);
+	}
+
+	for (i = 0; i < FW_NCHIPS; i++) {
+		if (fw_chips[i].lmp_subver == v->lmp_subver) {
+			return(fw_chips[i].name);
+		}
+	}
+
+	return(NULL);
+}
+
+int
+fw_chip_subver(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < FW_NCHIPS; i++) {
+		if (strcasecmp(fw_chips[i].name, name) == 0) {
+			return(fw_chips[i].lmp_subver);
+		}
+	}
+
+	return(-1);
+}
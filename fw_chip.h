@@ -0,0 +1,32 @@
+/*****************************************************************************
+**
+**  Name:          fw_chip.h
+**
+**  Description:   Chip identification from HCI Read Local Version.
+**
+**                 Broadcom controllers report an LMP subversion that names
+**                 the chip and its revision exactly.  A table maps it to
+**                 the chip id Read Local Name would return, which then
+**                 goes through the alias rules as usual; a chip missing
+**                 from the table is identified by its name instead.
+**
+******************************************************************************/
+
+#ifndef __FW_CHIP__H__
+#define __FW_CHIP__H__
+
+#define FW_CHIP_BROADCOM	0x000f	/* manufacturer, Bluetooth SIG id */
+
+typedef struct {
+	int hci_rev;
+	int lmp_subver;
+	int manufacturer;
+} fw_chip_version_t;
+
+/* Chip id of a controller, NULL when the table does not know it */
+extern const char *fw_chip_name(const fw_chip_version_t *v);
+
+/* LMP subversion a chip id is known by, -1 for none */
+extern int fw_chip_subver(const char *name);
+
+#endif
@@ -0,0 +1,570 @@
+/*****************************************************************************
+**
+**  Name:          fw_compile.c
+**
+**  Description:   Build host tool that checks a firmware tree offline.
+**
+**                 It is invoked in the form
+**					fw_compile [-j jobs] [-o out_dir] [-s store_dir] fw_dir
+**
+**                 Every HCD image under fw_dir (raw or compressed) is
+**                 walked with the record iterator the download uses.  Its
+**                 framing and opcodes are checked: vendor commands only,
+**                 Write_RAM records carrying an address and Launch_RAM
+**                 last.  The decompressed records are hashed (SHA-256)
+**                 and counted, and valid images compiled into
+**                 out_dir/<sha256>.h4, the exact bytes the download writes
+**                 to the UART: each record behind its H4 type byte.
+**                 Images are spread over jobs threads, all online CPUs by
+**                 default.
+**
+**                 out_dir/manifest lists every image with its size,
+**                 modification time, hash, status and statistics.  On the
+**                 next run an image whose size and modification time match
+**                 its manifest entry (and whose .h4 is still there) is
+**                 taken from the manifest instead of being read again.
+**
+**                 With -s, valid images are also installed in the firmware
+**                 store store_dir (see fw_store.h) as decompressed HCD
+**                 objects, each under the chip ID its file is named after.
+**                 Images with the same content become one object.
+**
+**                 The exit status is 1 if any image is invalid.
+**
+******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "hcd.h"
+#include "sha256.h"
+#include "fw_store.h"
+
+#define FW_MANIFEST		"manifest"
+#define FW_MAX_JOBS		64
+
+#define HCI_WRITE_RAM		0xfc4c
+#define HCI_LAUNCH_RAM		0xfc4e
+#define HCI_OGF_VENDOR		0x3f
+
+typedef struct {
+	char path[HCD_PATH_LEN];	/* relative to fw_dir */
+	long long size;
+	long long mtime;		/* ns */
+	char hash[SHA256_HEX_LEN];
+	char status[16];		/* "ok" or what is wrong */
+	int records;
+	int write_ram;
+	unsigned long h4_bytes;
+	unsigned long addr_min;		/* RAM written, addr_max excluded */
+	unsigned long addr_max;
+	int reused;			/* taken from the last manifest */
+} fw_entry_t;
+
+static const char *fw_dir;
+static const char *out_dir = ".";
+static const char *store_dir;
+
+static fw_entry_t *images;
+static int nimages, cap_images;
+
+static fw_entry_t *last;
+static int nlast;
+
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_image;
+
+void
+log2file(const char *fmt, ...)
+{
+	va_list vl;
+
+	va_start(vl, fmt);
+	vfprintf(stderr, fmt, vl);
+	va_end(vl);
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	return(strcmp(((const fw_entry_t *)a)->path,
+		((const fw_entry_t *)b)->path));
+}
+
+static int
+add_image(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	fw_entry_t *e;
+	int base_len;
+
+	if (flag != FTW_F || hcd_file_type(path + ftw->base, &base_len) < 0) {
+		return(0);
+	}
+
+	if (nimages == cap_images) {
+		cap_images = cap_images ? 2 * cap_images : 64;
+		if ((e = realloc(images, cap_images * sizeof(*e))) == NULL) {
+			return(-1);
+		}
+		images = e;
+	}
+
+	e = &images[nimages++];
+	memset(e, 0, sizeof(*e));
+	snprintf(e->path, sizeof(e->path), "%s",
+		path + strlen(fw_dir) + 1);
+	e->size = st->st_size;
+	e->mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+
+	return(0);
+}
+
+/* Entries of the manifest a previous run left, sorted by path */
+static void
+read_manifest(void)
+{
+	char name[HCD_PATH_LEN], line[HCD_PATH_LEN + 256];
+	fw_entry_t e;
+	FILE *fp;
+	int cap = 0;
+
+	snprintf(name, sizeof(name), "%s/%s", out_dir, FW_MANIFEST);
+	if ((fp = fopen(name, "r")) == NULL) {
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		memset(&e, 0, sizeof(e));
+		if (line[0] == '#' || sscanf(line,
+				"%1023[^\t]\t%lld\t%lld\t%64s\t%15s\t%d\t%d\t%lu"
+				"\t%lx\t%lx", e.path, &e.size, &e.mtime, e.hash,
+				e.status, &e.records, &e.write_ram, &e.h4_bytes,
+				&e.addr_min, &e.addr_max) != 10) {
+			continue;
+		}
+
+		if (nlast == cap) {
+			cap = cap ? 2 * cap : 64;
+			if ((last = realloc(last, cap * sizeof(e))) == NULL) {
+				nlast = 0;
+				break;
+			}
+		}
+		last[nlast++] = e;
+	}
+
+	fclose(fp);
+	qsort(last, nlast, sizeof(*last), entry_cmp);
+}
+
+/* Take the entry from the last run if the image has not changed */
+static int
+reuse_image(fw_entry_t *e)
+{
+	char name[HCD_PATH_LEN];
+	fw_entry_t *l;
+
+	if ((l = bsearch(e, last, nlast, sizeof(*last), entry_cmp)) == NULL
+			|| l->size != e->size || l->mtime != e->mtime) {
+		return(0);
+	}
+
+	snprintf(name, sizeof(name), "%s/%s.h4", out_dir, l->hash);
+	if (strcmp(l->status, "ok") == 0 && access(name, F_OK) < 0) {
+		return(0);
+	}
+
+	if (store_dir != NULL && strcmp(l->status, "ok") == 0) {
+		fw_store_object(store_dir, l->hash, name, sizeof(name));
+		if (access(name, F_OK) < 0) {
+			return(0);
+		}
+	}
+
+	*e = *l;
+	e->reused = 1;
+
+	return(1);
+}
+
+/* First thing wrong with a record, NULL if it is fine */
+static const char *
+check_record(fw_entry_t *e, const unsigned char *rec, int len, int launched)
+{
+	int opcode = rec[0] | rec[1] << 8;
+	unsigned long addr;
+
+	if (launched) {
+		return("after-launch");
+	}
+
+	if (opcode >> 10 != HCI_OGF_VENDOR) {
+		return("opcode");
+	}
+
+	if (opcode != HCI_WRITE_RAM) {
+		return(NULL);
+	}
+
+	if (rec[2] < 4) {
+		return("write-ram");
+	}
+
+	addr = rec[3] | rec[4] << 8 | rec[5] << 16 | (unsigned long)rec[6] << 24;
+	if (e->write_ram == 0 || addr < e->addr_min) {
+		e->addr_min = addr;
+	}
+	if (addr + rec[2] - 4 > e->addr_max) {
+		e->addr_max = addr + rec[2] - 4;
+	}
+	e->write_ram++;
+
+	return(NULL);
+}
+
+static void
+compile_image(fw_entry_t *e, int n)
+{
+	char path[2 * HCD_PATH_LEN], tmp[2 * HCD_PATH_LEN];
+	char out[2 * HCD_PATH_LEN], obj[2 * HCD_PATH_LEN];
+	unsigned char digest[SHA256_LEN];
+	const unsigned char *rec;
+	const char *status = NULL;
+	hcd_image_t img;
+	sha256_t c;
+	size_t off = 0;
+	FILE *fp, *ofp = NULL;
+	int len, launched = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", fw_dir, e->path);
+	snprintf(tmp, sizeof(tmp), "%s/.%d.h4.tmp", out_dir, n);
+
+	if (hcd_map(path, &img) < 0) {
+		snprintf(e->status, sizeof(e->status), "%s",
+			errno == EINVAL ? "framing" : "unreadable");
+		return;
+	}
+
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		snprintf(e->status, sizeof(e->status), "unwritable");
+		hcd_unmap(&img);
+		return;
+	}
+
+	if (store_dir != NULL) {
+		snprintf(obj, sizeof(obj), "%s/%s/.%d.%d.tmp", store_dir,
+			FW_STORE_OBJECTS, (int)getpid(), n);
+	}
+
+	if (store_dir != NULL && (ofp = fopen(obj, "w")) == NULL) {
+		snprintf(e->status, sizeof(e->status), "unwritable");
+		fclose(fp);
+		unlink(tmp);
+		hcd_unmap(&img);
+		return;
+	}
+
+	hcd_start(&img);
+	sha256_init(&c);
+
+	while ((rec = hcd_next_record(&img, &off, &len)) != NULL) {
+		sha256_update(&c, rec, len);
+		putc(0x01, fp);
+		fwrite(rec, 1, len, fp);
+		if (ofp != NULL) {
+			fwrite(rec, 1, len, ofp);
+		}
+		e->records++;
+		e->h4_bytes += 1 + len;
+
+		if (status == NULL) {
+			status = check_record(e, rec, len, launched);
+		}
+		launched |= (rec[0] | rec[1] << 8) == HCI_LAUNCH_RAM;
+	}
+
+	/* Compressed images only know their size once fully inflated */
+	if (status == NULL && (img.nrecords < 0 || off != img.len)) {
+		status = "truncated";
+	}
+
+	if (status == NULL && !launched) {
+		status = "no-launch";
+	}
+
+	hcd_unmap(&img);
+	sha256_final(&c, digest);
+	sha256_hex(digest, e->hash);
+
+	if (fclose(fp) != 0 && status == NULL) {
+		status = "unwritable";
+	}
+
+	if (ofp != NULL && fclose(ofp) != 0 && status == NULL) {
+		status = "unwritable";
+	}
+
+	snprintf(out, sizeof(out), "%s/%s.h4", out_dir, e->hash);
+	if (status == NULL && rename(tmp, out) < 0) {
+		status = "unwritable";
+	}
+
+	if (ofp != NULL && status == NULL
+			&& fw_store_put(store_dir, e->hash, obj) < 0) {
+		status = "unwritable";
+	}
+
+	if (status != NULL) {
+		unlink(tmp);
+		if (ofp != NULL) {
+			unlink(obj);
+		}
+	}
+
+	snprintf(e->status, sizeof(e->status), "%s", status ? status : "ok");
+}
+
+static void *
+worker(void *arg)
+{
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&next_lock);
+		i = next_image++;
+		pthread_mutex_unlock(&next_lock);
+
+		if (i >= nimages) {
+			return(NULL);
+		}
+
+		if (!reuse_image(&images[i])) {
+			compile_image(&images[i], i);
+		}
+	}
+}
+
+static int
+write_manifest(void)
+{
+	char name[HCD_PATH_LEN], tmp[HCD_PATH_LEN + 8];
+	fw_entry_t *e;
+	FILE *fp;
+	int i;
+
+	snprintf(name, sizeof(name), "%s/%s", out_dir, FW_MANIFEST);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		return(-1);
+	}
+
+	fprintf(fp, "# path\tsize\tmtime_ns\tsha256\tstatus\trecords\t"
+		"write_ram\th4_bytes\taddr_min\taddr_max\n");
+
+	for (i = 0; i < nimages; i++) {
+		e = &images[i];
+		fprintf(fp, "%s\t%lld\t%lld\t%s\t%s\t%d\t%d\t%lu\t%08lx\t%08lx\n",
+			e->path, e->size, e->mtime, e->hash[0] ? e->hash : "-",
+			e->status, e->records, e->write_ram, e->h4_bytes,
+			e->addr_min, e->addr_max);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, name) < 0) {
+		unlink(tmp);
+		return(-1);
+	}
+
+	return(0);
+}
+
+/* Point the chip ID of every valid image at its object in the store */
+static int
+install_images(void)
+{
+	fw_store_entry_t *s;
+	const char *base;
+	int i, j, k, n = 0, nobjects = 0, len, ret;
+
+	if ((s = calloc(nimages ? nimages : 1, sizeof(*s))) == NULL) {
+		return(-1);
+	}
+
+	for (i = 0; i < nimages; i++) {
+		if (strcmp(images[i].status, "ok") != 0) {
+			continue;
+		}
+
+		base = strrchr(images[i].path, '/');
+		base = base ? base + 1 : images[i].path;
+		hcd_file_type(base, &len);
+		if (len >= HCD_NAME_LEN) {
+			len = HCD_NAME_LEN - 1;
+		}
+
+		for (k = 0; k < len; k++) {
+			s[n].chip_id[k] = toupper((unsigned char)base[k]);
+		}
+		memcpy(s[n].hash, images[i].hash, sizeof(s[n].hash));
+
+		/* The first image in path order owns a chip ID */
+		for (j = 0; j < n; j++) {
+			if (strcmp(s[j].chip_id, s[n].chip_id) == 0) {
+				break;
+			}
+		}
+
+		if (j < n) {
+			if (strcmp(s[j].hash, s[n].hash) != 0) {
+				fprintf(stderr, "fw_compile: %s: %s is already "
+					"taken by another image\n",
+					images[i].path, s[n].chip_id);
+			}
+			memset(&s[n], 0, sizeof(s[n]));
+			continue;
+		}
+
+		for (j = 0; j < n; j++) {
+			if (strcmp(s[j].hash, s[n].hash) == 0) {
+				break;
+			}
+		}
+		nobjects += j == n;
+		n++;
+	}
+
+	ret = fw_store_update(store_dir, s, n);
+	if (ret == 0) {
+		printf("%s: %d chip IDs, %d objects\n", store_dir, n,
+			nobjects);
+	}
+
+	free(s);
+
+	return(ret);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: fw_compile [-j jobs] [-o out_dir] "
+		"[-s store_dir] fw_dir\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	pthread_t threads[FW_MAX_JOBS];
+	struct timespec t0, t1;
+	int i, c, jobs = 0, reused = 0, bad = 0;
+
+	while ((c = getopt(argc, argv, "j:o:s:")) != -1) {
+		switch (c) {
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'o':
+			out_dir = optarg;
+			break;
+		case 's':
+			store_dir = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+	}
+
+	fw_dir = argv[optind];
+	for (i = strlen(fw_dir); i > 1 && fw_dir[i - 1] == '/'; i--) {
+		argv[optind][i - 1] = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (jobs <= 0 && (jobs = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+		jobs = 1;
+	}
+	if (jobs > FW_MAX_JOBS) {
+		jobs = FW_MAX_JOBS;
+	}
+
+	if (mkdir(out_dir, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "fw_compile: can't create %s, error %d\n",
+			out_dir, errno);
+		return(2);
+	}
+
+	if (store_dir != NULL && fw_store_create(store_dir) < 0) {
+		fprintf(stderr, "fw_compile: can't create %s, error %d\n",
+			store_dir, errno);
+		return(2);
+	}
+
+	if (nftw(fw_dir, add_image, 16, FTW_PHYS) != 0) {
+		fprintf(stderr, "fw_compile: can't walk %s, error %d\n",
+			fw_dir, errno);
+		return(2);
+	}
+
+	qsort(images, nimages, sizeof(*images), entry_cmp);
+	read_manifest();
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+			break;
+		}
+	}
+
+	/* Without any thread, do it all here */
+	if (i == 0) {
+		worker(NULL);
+	}
+
+	while (--i >= 0) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < nimages; i++) {
+		reused += images[i].reused;
+		if (strcmp(images[i].status, "ok") != 0) {
+			fprintf(stderr, "fw_compile: %s: %s\n", images[i].path,
+				images[i].status);
+			bad++;
+		}
+	}
+
+	if (write_manifest() < 0) {
+		fprintf(stderr, "fw_compile: can't write %s/%s\n", out_dir,
+			FW_MANIFEST);
+		return(2);
+	}
+
+	if (store_dir != NULL && install_images() < 0) {
+		fprintf(stderr, "fw_compile: can't update %s/%s\n",
+			store_dir, FW_STORE_MANIFEST);
+		return(2);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%d images: %d compiled, %d unchanged, %d invalid, "
+		"%ldms with %d jobs\n", nimages, nimages - reused, reused, bad,
+		(t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec)
+			/ 1000000, jobs);
+
+	return(bad ? 1 : 0);
+}
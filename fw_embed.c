@@ -0,0 +1,67 @@
+/*****************************************************************************
+**
+**  Name:          fw_embed.c
+**
+**  Description:   Lookup of the HCD images linked into the binary.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "fw_embed.h"
+
+typedef struct {
+	const char *chip_id;
+	const unsigned char *data;
+	unsigned int len;
+	const unsigned short *rec_lens;
+	int nrecords;
+} fw_embed_image_t;
+
+#include "fw_embed_table.h"
+
+int
+fw_embed_count(void)
+{
+	return(sizeof(fw_embed_images) / sizeof(fw_embed_images[0]) - 1);
+}
+
+/* Whether an image named e.g. BCM4345C0_003.001.025.0187 is chip_id's */
+static int
+fw_embed_match(const char *name, const char *chip_id)
+{
+	size_t len = strcspn(name, "_");
+
+	return(strcasecmp(name, chip_id) == 0
+		|| (strlen(chip_id) == len
+			&& strncasecmp(name, chip_id, len) == 0));
+}
+
+int
+fw_embed_find(const char *chip_id, hcd_image_t *img)
+{
+	const fw_embed_image_t *e;
+
+	for (e = fw_embed_images; e->chip_id; e++) {
+		if (fw_embed_match(e->chip_id, chip_id)) {
+			break;
+		}
+	}
+
+	if (e->chip_id == NULL) {
+		return(-1);
+	}
+
+	memset(img, 0, sizeof(*img));
+	snprintf(img->name, sizeof(img->name), "%s", e->chip_id);
+	snprintf(img->path, sizeof(img->path), "builtin:%s", e->chip_id);
+	img->data = e->data;
+	img->len = e->len;
+	img->nrecords = e->nrecords;
+	img->rec_lens = e->rec_lens;
+	img->type = HCD_BUILTIN;
+
+	return(0);
+}
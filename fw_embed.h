@@ -0,0 +1,28 @@
+/*****************************************************************************
+**
+**  Name:          fw_embed.h
+**
+**  Description:   HCD images linked into the binary.
+**
+**                 Images listed in EMBED_FW at build time are parsed by
+**                 gen_fw_embed and kept in a read-only record table, so a
+**                 matching chip can be patched before any filesystem is
+**                 mounted.  The patchram folder remains the fallback.
+**
+******************************************************************************/
+
+#ifndef __FW_EMBED__H__
+#define __FW_EMBED__H__
+
+#include "hcd.h"
+
+/* Number of images linked in */
+extern int fw_embed_count(void);
+
+/*
+ * Point img at the embedded image for chip_id, which also matches a file
+ * name with a version after the chip id.  Returns 0 on success.
+ */
+extern int fw_embed_find(const char *chip_id, hcd_image_t *img);
+
+#endif
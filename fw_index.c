@@ -0,0 +1,513 @@
+/*****************************************************************************
+**
+**  Name:          fw_index.c
+**
+**  Description:   Build, cache and query the patchram folder index.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fw_index.h"
+
+extern void log2file(const char *fmt, ...);
+
+#define FW_INDEX_MAGIC		0x58444346	/* "FCDX" */
+#define FW_INDEX_VERSION	3
+
+/* Indexes built without zstd support leave the .hcd.zst files out */
+#ifdef HAVE_ZSTD
+#define FW_INDEX_FEATURES	0x100
+#else
+#define FW_INDEX_FEATURES	0
+#endif
+
+typedef struct {
+	unsigned int magic;
+	unsigned int version;
+	long long mtime_sec;
+	long long mtime_nsec;
+	char folder[HCD_PATH_LEN];
+	char last[HCD_NAME_LEN];
+	int nentries;
+	int nbuckets;
+} fw_index_hdr_t;
+
+static unsigned int
+fw_index_hash(const char *key)
+{
+	unsigned int h = 2166136261u;
+
+	while (*key) {
+		h = (h ^ (unsigned char)toupper((unsigned char)*key++)) * 16777619u;
+	}
+
+	return(h);
+}
+
+/* Upper case copy of name without its extensions */
+static void
+fw_index_normalize(const char *name, char *out, int len)
+{
+	int i, base;
+
+	if (hcd_file_type(name, &base) < 0) {
+		base = strlen(name);
+	}
+
+	for (i = 0; i < len - 1 && i < base; i++) {
+		out[i] = toupper((unsigned char)name[i]);
+	}
+
+	out[i] = 0;
+}
+
+static int
+fw_index_find(const fw_index_t *idx, const char *key)
+{
+	int i;
+
+	if (idx->nbuckets == 0) {
+		return(-1);
+	}
+
+	i = idx->buckets[fw_index_hash(key) & (idx->nbuckets - 1)];
+
+	while (i >= 0 && strcasecmp(idx->entries[i].key, key) != 0) {
+		i = idx->entries[i].next;
+	}
+
+	return(i);
+}
+
+/* Should file replace the current owner of a bare chip id key? */
+static int
+fw_index_prefer(const char *file, const char *cur)
+{
+	char a[HCD_NAME_LEN], b[HCD_NAME_LEN];
+	const char *va, *vb;
+	int c, base;
+
+	fw_index_normalize(file, a, sizeof(a));
+	fw_index_normalize(cur, b, sizeof(b));
+	va = strchr(a, '_');
+	vb = strchr(b, '_');
+
+	/* An exactly named file wins, then the highest version */
+	if (va == NULL || vb == NULL) {
+		c = (va == NULL) - (vb == NULL);
+	} else {
+		c = hcd_version_cmp(va + 1, vb + 1);
+	}
+
+	/* Then the uncompressed copy, which needs no inflating */
+	if (c == 0) {
+		c = hcd_file_type(file, &base) == HCD_RAW;
+	}
+
+	return(c > 0);
+}
+
+static arena_t *
+fw_index_arena(const fw_index_t *idx)
+{
+	return(idx->heap ? NULL : idx->arena);
+}
+
+/* Move the entries to the heap, for a folder the arena can't index */
+static int
+fw_index_to_heap(fw_index_t *idx, int cap)
+{
+	fw_index_entry_t *e;
+
+	if (idx->arena == NULL || idx->heap) {
+		return(-1);
+	}
+
+	if ((e = malloc((cap ? cap : 1) * sizeof(*e))) == NULL) {
+		return(-1);
+	}
+
+	if (idx->nentries) {
+		memcpy(e, idx->entries, idx->nentries * sizeof(*e));
+	}
+
+	log2file("FW index of %s not in the arena, using the heap\n",
+		idx->folder);
+	arena_free(idx->arena, idx->entries);
+	idx->entries = e;
+	idx->heap = 1;
+
+	return(0);
+}
+
+static int
+fw_index_add(fw_index_t *idx, int *cap, const char *key, const char *file)
+{
+	fw_index_entry_t *e;
+	int i;
+
+	for (i = 0; i < idx->nentries; i++) {
+		if (strcmp(idx->entries[i].key, key) == 0) {
+			if (fw_index_prefer(file, idx->entries[i].file)) {
+				snprintf(idx->entries[i].file,
+					sizeof(idx->entries[i].file), "%s", file);
+			}
+			return(0);
+		}
+	}
+
+	if (idx->nentries == *cap) {
+		e = arena_realloc(fw_index_arena(idx), idx->entries,
+			*cap * sizeof(*e), (*cap ? *cap * 2 : 16) * sizeof(*e));
+		if (e == NULL && fw_index_to_heap(idx, *cap) == 0) {
+			e = realloc(idx->entries,
+				(*cap ? *cap * 2 : 16) * sizeof(*e));
+		}
+		if (e == NULL) {
+			return(-1);
+		}
+		*cap = *cap ? *cap * 2 : 16;
+		idx->entries = e;
+	}
+
+	e = &idx->entries[idx->nentries++];
+	snprintf(e->key, sizeof(e->key), "%s", key);
+	snprintf(e->file, sizeof(e->file), "%s", file);
+
+	return(0);
+}
+
+static int
+fw_index_hash_entries(fw_index_t *idx)
+{
+	unsigned int b;
+	int i;
+
+	for (idx->nbuckets = 16; idx->nbuckets < 2 * idx->nentries;
+			idx->nbuckets *= 2)
+		;
+
+	if ((idx->buckets = arena_alloc(fw_index_arena(idx),
+			idx->nbuckets * sizeof(int))) == NULL
+			&& fw_index_to_heap(idx, idx->nentries) == 0) {
+		idx->buckets = malloc(idx->nbuckets * sizeof(int));
+	}
+
+	if (idx->buckets == NULL) {
+		return(-1);
+	}
+
+	memset(idx->buckets, 0xff, idx->nbuckets * sizeof(int));
+
+	for (i = 0; i < idx->nentries; i++) {
+		b = fw_index_hash(idx->entries[i].key) & (idx->nbuckets - 1);
+		idx->entries[i].next = idx->buckets[b];
+		idx->buckets[b] = i;
+	}
+
+	return(0);
+}
+
+static int
+fw_index_build(fw_index_t *idx)
+{
+	char key[HCD_NAME_LEN], *p;
+	struct dirent *de;
+	int cap = 0, base, full = 0;
+	DIR *dir;
+
+	if ((dir = opendir(idx->folder)) == NULL) {
+		log2file("FW folder %s could not be scanned\n", idx->folder);
+		return(-1);
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (hcd_file_type(de->d_name, &base) < 0 || base == 0) {
+			continue;
+		}
+
+		fw_index_normalize(de->d_name, key, sizeof(key));
+		full = fw_index_add(idx, &cap, key, de->d_name) < 0;
+
+		/* Also reachable by the bare chip id */
+		if (!full && (p = strchr(key, '_')) != NULL) {
+			*p = 0;
+			full = fw_index_add(idx, &cap, key, de->d_name) < 0;
+		}
+
+		if (full) {
+			break;
+		}
+	}
+
+	closedir(dir);
+
+	/* A partial index would hide files, and be cached that way */
+	if (full) {
+		log2file("FW index of %s incomplete, no memory\n", idx->folder);
+		return(-1);
+	}
+
+	return(fw_index_hash_entries(idx));
+}
+
+int
+fw_index_scan(const char *folder, const char *chip_id, char *path, int len)
+{
+	char key[HCD_NAME_LEN], best[NAME_MAX + 1], *p;
+	struct dirent *de;
+	int base;
+	DIR *dir;
+
+	if ((dir = opendir(folder[0] ? folder : "/")) == NULL) {
+		return(-1);
+	}
+
+	best[0] = 0;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (hcd_file_type(de->d_name, &base) < 0 || base == 0) {
+			continue;
+		}
+
+		/* The same keys fw_index_build() gives the file */
+		fw_index_normalize(de->d_name, key, sizeof(key));
+		if (strcasecmp(key, chip_id) != 0) {
+			if ((p = strchr(key, '_')) == NULL) {
+				continue;
+			}
+			*p = 0;
+			if (strcasecmp(key, chip_id) != 0) {
+				continue;
+			}
+		}
+
+		if (best[0] == 0 || fw_index_prefer(de->d_name, best)) {
+			snprintf(best, sizeof(best), "%s", de->d_name);
+		}
+	}
+
+	closedir(dir);
+
+	if (best[0] == 0) {
+		return(-1);
+	}
+
+	snprintf(path, len, "%s/%s", folder, best);
+
+	return(0);
+}
+
+/* Whether the tables read from a cache can be walked safely */
+static int
+fw_index_check(const fw_index_t *idx)
+{
+	const fw_index_entry_t *e;
+	int i;
+
+	for (i = 0; i < idx->nbuckets; i++) {
+		if (idx->buckets[i] < -1 || idx->buckets[i] >= idx->nentries) {
+			return(-1);
+		}
+	}
+
+	for (i = 0; i < idx->nentries; i++) {
+		e = &idx->entries[i];
+		/* Chains run to lower entries, as built, so they end */
+		if (e->next < -1 || e->next >= i
+				|| memchr(e->key, 0, sizeof(e->key)) == NULL
+				|| memchr(e->file, 0, sizeof(e->file)) == NULL) {
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+static int
+fw_index_load(fw_index_t *idx)
+{
+	fw_index_hdr_t hdr;
+	struct stat st;
+	size_t nb, ne;
+	int fd, ok = 0;
+
+	if ((fd = open(idx->cache, O_RDONLY)) == -1) {
+		return(-1);
+	}
+
+	/* The file must hold exactly the tables its header announces */
+	if (fstat(fd, &st) == 0
+			&& read(fd, &hdr, sizeof(hdr)) == sizeof(hdr)
+			&& hdr.magic == FW_INDEX_MAGIC
+			&& hdr.version == (FW_INDEX_VERSION | FW_INDEX_FEATURES)
+			&& hdr.mtime_sec == idx->mtime_sec
+			&& hdr.mtime_nsec == idx->mtime_nsec
+			&& strncmp(hdr.folder, idx->folder, HCD_PATH_LEN) == 0
+			&& hdr.nbuckets > 0
+			&& (hdr.nbuckets & (hdr.nbuckets - 1)) == 0
+			&& hdr.nentries >= 0
+			&& (size_t)st.st_size == sizeof(hdr)
+				+ (size_t)hdr.nbuckets * sizeof(int)
+				+ (size_t)hdr.nentries * sizeof(fw_index_entry_t)) {
+		nb = hdr.nbuckets * sizeof(int);
+		ne = hdr.nentries * sizeof(fw_index_entry_t);
+		idx->entries = arena_alloc(idx->arena, ne);
+		idx->buckets = arena_alloc(idx->arena, nb);
+
+		if ((!idx->entries || !idx->buckets) && idx->arena != NULL) {
+			fw_index_free(idx);
+			idx->heap = 1;
+			idx->entries = malloc(ne ? ne : 1);
+			idx->buckets = malloc(nb);
+		}
+
+		if (idx->buckets && idx->entries
+				&& read(fd, idx->buckets, nb) == (ssize_t)nb
+				&& read(fd, idx->entries, ne) == (ssize_t)ne) {
+			idx->nbuckets = hdr.nbuckets;
+			idx->nentries = hdr.nentries;
+			memcpy(idx->last, hdr.last, sizeof(idx->last));
+			idx->last[HCD_NAME_LEN - 1] = 0;
+			ok = fw_index_check(idx) == 0;
+		}
+	}
+
+	close(fd);
+
+	if (!ok) {
+		fw_index_free(idx);
+		return(-1);
+	}
+
+	return(0);
+}
+
+static void
+fw_index_save(const fw_index_t *idx)
+{
+	char tmp[HCD_PATH_LEN + 8];
+	fw_index_hdr_t hdr;
+	int fd, ok;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FW_INDEX_MAGIC;
+	hdr.version = FW_INDEX_VERSION | FW_INDEX_FEATURES;
+	hdr.mtime_sec = idx->mtime_sec;
+	hdr.mtime_nsec = idx->mtime_nsec;
+	memcpy(hdr.folder, idx->folder, sizeof(hdr.folder));
+	memcpy(hdr.last, idx->last, sizeof(hdr.last));
+	hdr.nentries = idx->nentries;
+	hdr.nbuckets = idx->nbuckets;
+
+	/* A new file of our own: nothing planted under the name is opened */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", idx->cache);
+
+	if ((fd = mkstemp(tmp)) == -1) {
+		return;
+	}
+	fchmod(fd, 0644);
+
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr)
+		&& write(fd, idx->buckets, idx->nbuckets * sizeof(int))
+			== (ssize_t)(idx->nbuckets * sizeof(int))
+		&& write(fd, idx->entries, idx->nentries * sizeof(fw_index_entry_t))
+			== (ssize_t)(idx->nentries * sizeof(fw_index_entry_t));
+	close(fd);
+
+	if (!ok || rename(tmp, idx->cache) < 0) {
+		log2file("FW index cache %s could not be written\n", idx->cache);
+		unlink(tmp);
+	}
+}
+
+int
+fw_index_open(fw_index_t *idx, const char *folder, const char *cache,
+	arena_t *arena)
+{
+	struct stat st;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->arena = arena;
+	snprintf(idx->folder, sizeof(idx->folder), "%s", folder[0] ? folder : "/");
+	snprintf(idx->cache, sizeof(idx->cache), "%s", cache);
+
+	if (stat(idx->folder, &st) < 0) {
+		log2file("FW folder %s could not be opened, error %d\n",
+			idx->folder, errno);
+		return(-1);
+	}
+
+	idx->mtime_sec = st.st_mtim.tv_sec;
+	idx->mtime_nsec = st.st_mtim.tv_nsec;
+
+	if (fw_index_load(idx) == 0) {
+		log2file("FW index: %d entries from %s\n", idx->nentries, idx->cache);
+		return(0);
+	}
+
+	if (fw_index_build(idx) < 0) {
+		fw_index_free(idx);
+		return(-1);
+	}
+
+	log2file("FW index: %d entries rebuilt for %s\n", idx->nentries,
+		idx->folder);
+	fw_index_save(idx);
+
+	return(0);
+}
+
+const fw_index_entry_t *
+fw_index_lookup(const fw_index_t *idx, const char *chip_id)
+{
+	int i = fw_index_find(idx, chip_id);
+
+	return(i < 0 ? NULL : &idx->entries[i]);
+}
+
+void
+fw_index_path(const fw_index_t *idx, const fw_index_entry_t *e,
+	char *path, int len)
+{
+	snprintf(path, len, "%s/%s", idx->folder, e->file);
+}
+
+void
+fw_index_set_last(fw_index_t *idx, const char *key)
+{
+	if (strcmp(idx->last, key) == 0) {
+		return;
+	}
+
+	snprintf(idx->last, sizeof(idx->last), "%s", key);
+	fw_index_save(idx);
+}
+
+void
+fw_index_free(fw_index_t *idx)
+{
+	/*
+	 * Latest first.  An arena only takes its last block back, the
+	 * buckets, and keeps the entries used until it is destroyed.
+	 */
+	arena_free(fw_index_arena(idx), idx->buckets);
+	arena_free(fw_index_arena(idx), idx->entries);
+	idx->buckets = NULL;
+	idx->entries = NULL;
+	idx->nbuckets = 0;
+	idx->nentries = 0;
+	idx->heap = 0;
+}
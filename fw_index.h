@@ -0,0 +1,69 @@
+/*****************************************************************************
+**
+**  Name:          fw_index.h
+**
+**  Description:   Hashed index of the patchram folder.
+**
+**                 The index maps normalized chip IDs ("BCM4345C0") and chip
+**                 ID plus version tuples ("BCM4345C0_003.001.025.0144") to
+**                 HCD file names.  It is built once and cached on disk; the
+**                 cache is thrown away whenever the folder mtime changes.
+**
+******************************************************************************/
+
+#ifndef __FW_INDEX__H__
+#define __FW_INDEX__H__
+
+#include "hcd.h"
+#include "arena.h"
+
+#define FW_INDEX_CACHE "/var/run/brcm_patchram_plus.idx"
+
+typedef struct {
+	char key[HCD_NAME_LEN];		/* normalized chip id [_version] */
+	char file[HCD_NAME_LEN * 2];	/* file name inside the folder */
+	int next;			/* next entry in the bucket, -1 ends */
+} fw_index_entry_t;
+
+typedef struct {
+	char folder[HCD_PATH_LEN];
+	char cache[HCD_PATH_LEN];
+	char last[HCD_NAME_LEN];	/* key resolved on the previous run */
+	long long mtime_sec;		/* folder mtime the index describes */
+	long long mtime_nsec;
+	int nentries;
+	int nbuckets;
+	int *buckets;
+	fw_index_entry_t *entries;
+	arena_t *arena;			/* tables come from here */
+	int heap;			/* or from the heap, the arena was full */
+} fw_index_t;
+
+/*
+ * Load the cached index for folder or rebuild it, with its tables in
+ * arena (NULL: the heap) or on the heap once the arena is full.  Returns
+ * 0 on success; an index that could not be completed is never used.
+ */
+extern int fw_index_open(fw_index_t *idx, const char *folder,
+	const char *cache, arena_t *arena);
+
+extern const fw_index_entry_t *fw_index_lookup(const fw_index_t *idx,
+	const char *chip_id);
+
+/*
+ * Read folder for the file the index would give chip_id, without an
+ * index.  Returns 0 with its full path in path.
+ */
+extern int fw_index_scan(const char *folder, const char *chip_id,
+	char *path, int len);
+
+/* Full path of an entry's file */
+extern void fw_index_path(const fw_index_t *idx, const fw_index_entry_t *e,
+	char *path, int len);
+
+/* Remember the key used on this run so the next one can prefetch it */
+extern void fw_index_set_last(fw_index_t *idx, const char *key);
+
+extern void fw_index_free(fw_index_t *idx);
+
+#endif
@@ -0,0 +1,150 @@
+/*****************************************************************************
+**
+**  Name:          fw_phash.c
+**
+**  Description:   Hash-and-displace minimal perfect hash construction.
+**
+******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "fw_phash.h"
+
+unsigned int
+fw_phash(unsigned int seed, const char *s, int len)
+{
+	unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return(h);
+}
+
+void
+fw_phash_chip_key(const char *id, char *key, int len)
+{
+	int i;
+
+	if (strncasecmp(id, "BCM", 3) == 0) {
+		id += 3;
+	}
+
+	for (i = 0; i < len - 1 && id[i] && !isspace((unsigned char)id[i]); i++) {
+		key[i] = toupper((unsigned char)id[i]);
+	}
+
+	key[i] = 0;
+}
+
+int
+fw_phash_nbuckets(int n)
+{
+	return(n > 1 ? (n + 1) / 2 : 1);
+}
+
+int
+fw_phash_build(const char **keys, int n, unsigned short *disp, int *slot)
+{
+	int nb = fw_phash_nbuckets(n);
+	int *bucket, *order, *size;
+	char *taken;
+	unsigned int d;
+	int b, i, j, k, t, ok = 0;
+
+	bucket = calloc(n + 1, sizeof(int));
+	order = calloc(nb, sizeof(int));
+	size = calloc(nb, sizeof(int));
+	taken = calloc(n + 1, 1);
+
+	if (!bucket || !order || !size || !taken) {
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		bucket[i] = fw_phash(0, keys[i], strlen(keys[i])) % nb;
+		size[bucket[i]]++;
+	}
+
+	/* Place the largest buckets first while most slots are free */
+	for (b = 0; b < nb; b++) {
+		for (j = b; j > 0 && size[order[j - 1]] < size[b]; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = b;
+	}
+
+	for (k = 0; k < nb; k++) {
+		b = order[k];
+		disp[b] = 0;
+
+		if (size[b] == 0) {
+			continue;
+		}
+
+		for (d = 1; d <= FW_PHASH_MAX_SEED; d++) {
+			for (i = 0; i < n; i++) {
+				if (bucket[i] != b) {
+					continue;
+				}
+
+				slot[i] = fw_phash(d, keys[i], strlen(keys[i])) % n;
+
+				/* Clashes with a placed key or one of this bucket */
+				for (t = 0; t < i; t++) {
+					if (bucket[t] == b && slot[t] == slot[i]) {
+						break;
+					}
+				}
+
+				if (taken[slot[i]] || t < i) {
+					break;
+				}
+			}
+
+			if (i == n) {
+				break;
+			}
+		}
+
+		if (d > FW_PHASH_MAX_SEED) {
+			goto out;
+		}
+
+		disp[b] = d;
+		for (i = 0; i < n; i++) {
+			if (bucket[i] == b) {
+				taken[slot[i]] = 1;
+			}
+		}
+	}
+
+	ok = 1;
+
+out:
+	free(bucket);
+	free(order);
+	free(size);
+	free(taken);
+
+	return(ok ? 0 : -1);
+}
+
+int
+fw_phash_slot(const unsigned short *disp, int n, const char *s, int len)
+{
+	int b = fw_phash(0, s, len) % fw_phash_nbuckets(n);
+
+	return(fw_phash(disp[b], s, len) % n);
+}
@@ -0,0 +1,39 @@
+/*****************************************************************************
+**
+**  Name:          fw_phash.h
+**
+**  Description:   Minimal perfect hashing of short chip id strings.
+**
+**                 Keys are first hashed into buckets; every bucket gets a
+**                 displacement seed that sends its keys to free slots, so
+**                 n keys occupy exactly n slots.  The same code builds the
+**                 compiled-in alias table (from gen_fw_alias on the build
+**                 host) and the tables of alias files loaded at runtime.
+**
+******************************************************************************/
+
+#ifndef __FW_PHASH__H__
+#define __FW_PHASH__H__
+
+#define FW_PHASH_MAX_SEED	0xffff
+
+extern unsigned int fw_phash(unsigned int seed, const char *s, int len);
+
+/* Chip ids are keyed upper case and without their "BCM" prefix */
+extern void fw_phash_chip_key(const char *id, char *key, int len);
+
+/* Number of buckets used for n keys */
+extern int fw_phash_nbuckets(int n);
+
+/*
+ * Find a displacement for every bucket.  On success disp[] (nbuckets
+ * entries) is filled, slot[i] is the slot of keys[i] and 0 is returned.
+ */
+extern int fw_phash_build(const char **keys, int n, unsigned short *disp,
+	int *slot);
+
+/* Slot to probe for s[0..len), the caller still compares the key */
+extern int fw_phash_slot(const unsigned short *disp, int n,
+	const char *s, int len);
+
+#endif
@@ -0,0 +1,244 @@
+/*****************************************************************************
+**
+**  Name:          fw_prefetch.c
+**
+**  Description:   Helper thread that indexes the patchram folder and maps
+**                 candidate HCD images while the UART bring-up is in flight.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fw_prefetch.h"
+
+extern void log2file(const char *fmt, ...);
+
+static hcd_image_t *
+fw_prefetch_mapped(fw_prefetch_t *pf, const char *path)
+{
+	int i;
+
+	for (i = 0; i < pf->nimages; i++) {
+		if (strcmp(pf->images[i].path, path) == 0) {
+			return(&pf->images[i]);
+		}
+	}
+
+	return(NULL);
+}
+
+/*
+ * The table is allocated once, FW_PREFETCH_MAX speculative images and the
+ * one the lookup needs, so guesses never take the lookup's memory.  From
+ * the heap when the arena can't hold it.
+ */
+static int
+fw_prefetch_table(fw_prefetch_t *pf)
+{
+	size_t len = (FW_PREFETCH_MAX + 1) * sizeof(hcd_image_t);
+
+	if (pf->images != NULL) {
+		return(0);
+	}
+
+	if ((pf->images = arena_alloc(pf->arena, len)) == NULL
+			&& pf->arena != NULL) {
+		log2file("FW prefetch table not in the arena, using the heap\n");
+		pf->heap = 1;
+		pf->images = arena_alloc(NULL, len);
+	}
+
+	if (pf->images == NULL) {
+		return(-1);
+	}
+
+	pf->cap = FW_PREFETCH_MAX + 1;
+
+	return(0);
+}
+
+/* Map the file at path, using at most limit entries of the table */
+static hcd_image_t *
+fw_prefetch_map_path(fw_prefetch_t *pf, const char *path, int limit)
+{
+	hcd_image_t *img;
+	int i;
+
+	if ((img = fw_prefetch_mapped(pf, path)) != NULL) {
+		return(img);
+	}
+
+	/* A slot fw_prefetch_release() emptied, before a new one */
+	for (i = 0; i < pf->nimages; i++) {
+		if (pf->images[i].path[0] == 0) {
+			img = &pf->images[i];
+			return(hcd_map(path, img) < 0 ? NULL : img);
+		}
+	}
+
+	if (pf->nimages >= limit || fw_prefetch_table(pf) < 0) {
+		return(NULL);
+	}
+
+	img = &pf->images[pf->nimages];
+	if (hcd_map(path, img) < 0) {
+		return(NULL);
+	}
+
+	pf->nimages++;
+
+	return(img);
+}
+
+static hcd_image_t *
+fw_prefetch_map(fw_prefetch_t *pf, const fw_index_entry_t *e, int limit)
+{
+	char path[HCD_PATH_LEN];
+
+	fw_index_path(&pf->index, e, path, sizeof(path));
+
+	return(fw_prefetch_map_path(pf, path, limit));
+}
+
+static void *
+fw_prefetch_thread(void *arg)
+{
+	fw_prefetch_t *pf = arg;
+	const fw_index_entry_t *e;
+	int i;
+
+	if (fw_index_open(&pf->index, pf->folder, pf->cache,
+			pf->arena) < 0) {
+		return(NULL);
+	}
+
+	pf->indexed = 1;
+
+	/* The chip rarely changes, so one image is normally enough */
+	if (pf->index.last[0]
+			&& (e = fw_index_lookup(&pf->index, pf->index.last)) != NULL
+			&& fw_prefetch_map(pf, e, FW_PREFETCH_MAX) != NULL) {
+		return(NULL);
+	}
+
+	for (i = 0; i < pf->index.nentries && pf->nimages < FW_PREFETCH_MAX;
+			i++) {
+		fw_prefetch_map(pf, &pf->index.entries[i], FW_PREFETCH_MAX);
+	}
+
+	return(NULL);
+}
+
+int
+fw_prefetch_start(fw_prefetch_t *pf, const char *folder, const char *cache,
+	arena_t *arena)
+{
+	memset(pf, 0, sizeof(*pf));
+	pf->arena = arena;
+	snprintf(pf->folder, sizeof(pf->folder), "%s", folder);
+	snprintf(pf->cache, sizeof(pf->cache), "%s", cache);
+
+	/* Here, so the helper never allocates it */
+	fw_prefetch_table(pf);
+
+	if (pthread_create(&pf->thread, NULL, fw_prefetch_thread, pf) != 0) {
+		return(-1);
+	}
+
+	pf->started = 1;
+
+	return(0);
+}
+
+static void
+fw_prefetch_join(fw_prefetch_t *pf)
+{
+	if (pf->started) {
+		pthread_join(pf->thread, NULL);
+		pf->started = 0;
+	}
+}
+
+/* Find chip_id's file in the folder itself, the index can't help */
+static hcd_image_t *
+fw_prefetch_open(fw_prefetch_t *pf, const char *chip_id)
+{
+	char path[HCD_PATH_LEN];
+	hcd_image_t *img;
+
+	if (fw_index_scan(pf->folder, chip_id, path, sizeof(path)) < 0) {
+		return(NULL);
+	}
+
+	if ((img = fw_prefetch_map_path(pf, path, FW_PREFETCH_MAX + 1))
+			!= NULL) {
+		log2file("FW for %s found without the index\n", chip_id);
+	}
+
+	return(img);
+}
+
+hcd_image_t *
+fw_prefetch_find(fw_prefetch_t *pf, const char *chip_id)
+{
+	const fw_index_entry_t *e;
+	hcd_image_t *img;
+
+	fw_prefetch_join(pf);
+
+	/* The helper could not be started, resolve synchronously */
+	if (!pf->indexed) {
+		if (fw_index_open(&pf->index, pf->folder, pf->cache,
+				pf->arena) < 0) {
+			return(fw_prefetch_open(pf, chip_id));
+		}
+		pf->indexed = 1;
+	}
+
+	if ((e = fw_index_lookup(&pf->index, chip_id)) == NULL) {
+		log2file("no FW for %s in the index of %s\n", chip_id,
+			pf->index.folder);
+		return(fw_prefetch_open(pf, chip_id));
+	}
+
+	if ((img = fw_prefetch_map(pf, e, FW_PREFETCH_MAX + 1)) != NULL) {
+		fw_index_set_last(&pf->index, e->key);
+	}
+
+	return(img);
+}
+
+void
+fw_prefetch_release(fw_prefetch_t *pf, const hcd_image_t *keep)
+{
+	int i;
+
+	fw_prefetch_join(pf);
+
+	/* Emptied, so a later lookup maps the file again */
+	for (i = 0; i < pf->nimages; i++) {
+		if (&pf->images[i] != keep && pf->images[i].path[0] != 0) {
+			hcd_unmap(&pf->images[i]);
+			pf->images[i].path[0] = 0;
+		}
+	}
+}
+
+void
+fw_prefetch_free(fw_prefetch_t *pf)
+{
+	fw_prefetch_release(pf, NULL);
+
+	if (pf->indexed) {
+		fw_index_free(&pf->index);
+		pf->indexed = 0;
+	}
+
+	arena_free(pf->heap ? NULL : pf->arena, pf->images);
+	pf->images = NULL;
+	pf->heap = 0;
+	pf->nimages = 0;
+	pf->cap = 0;
+}
@@ -0,0 +1,61 @@
+/*****************************************************************************
+**
+**  Name:          fw_prefetch.h
+**
+**  Description:   Background resolution of the patchram folder.
+**
+**                 While the controller is being reset and asked for its
+**                 name, a helper thread loads the folder index and maps and
+**                 validates the image the previous run used (or the first
+**                 FW_PREFETCH_MAX images when there is no history), so the
+**                 download can start as soon as the chip ID is known.  The
+**                 table always keeps a slot for the image actually asked
+**                 for.
+**
+******************************************************************************/
+
+#ifndef __FW_PREFETCH__H__
+#define __FW_PREFETCH__H__
+
+#include <pthread.h>
+
+#include "hcd.h"
+#include "fw_index.h"
+
+/* Images mapped ahead of the lookup at most */
+#define FW_PREFETCH_MAX		8
+
+typedef struct {
+	pthread_t thread;
+	int started;
+	int indexed;
+	fw_index_t index;
+	char folder[HCD_PATH_LEN];
+	char cache[HCD_PATH_LEN];
+	hcd_image_t *images;
+	int nimages;
+	int cap;
+	arena_t *arena;
+	int heap;			/* images came from the heap */
+} fw_prefetch_t;
+
+/*
+ * Start resolving folder in the background, allocating from arena (NULL:
+ * the heap).  Returns 0 on success.
+ */
+extern int fw_prefetch_start(fw_prefetch_t *pf, const char *folder,
+	const char *cache, arena_t *arena);
+
+/*
+ * Wait for the helper and return the image for chip_id (case-insensitive),
+ * opening at most one file when it was not prefetched.
+ */
+extern hcd_image_t *fw_prefetch_find(fw_prefetch_t *pf, const char *chip_id);
+
+/* Unmap every prefetched image except keep */
+extern void fw_prefetch_release(fw_prefetch_t *pf, const hcd_image_t *keep);
+
+/* Wait for the helper and free everything, including the kept image */
+extern void fw_prefetch_free(fw_prefetch_t *pf);
+
+#endif
@@ -0,0 +1,262 @@
+/*****************************************************************************
+**
+**  Name:          fw_store.c
+**
+**  Description:   Content-addressed firmware store, see fw_store.h.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "fw_store.h"
+
+extern void log2file(const char *fmt, ...);
+
+/* Parse a manifest line, 0 if it is an entry */
+static int
+fw_store_parse(const char *line, fw_store_entry_t *e)
+{
+	if (line[0] == '#' || sscanf(line, "%63s %64[0-9a-f]", e->chip_id,
+			e->hash) != 2 || strlen(e->hash) != 2 * SHA256_LEN) {
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * How well entry name serves chip_id: 2 for the same name, 1 when name is
+ * chip_id with a version (BCM4345C0_003.001.025.0187), else 0
+ */
+static int
+fw_store_match(const char *name, const char *chip_id)
+{
+	size_t len = strcspn(name, "_");
+
+	if (strcasecmp(name, chip_id) == 0) {
+		return(2);
+	}
+
+	return(name[len] == '_' && strlen(chip_id) == len
+		&& strncasecmp(name, chip_id, len) == 0);
+}
+
+void
+fw_store_object(const char *store, const char *hash, char *path, int len)
+{
+	snprintf(path, len, "%s/%s/%s.hcd", store, FW_STORE_OBJECTS, hash);
+}
+
+int
+fw_store_find(const char *store, const char *chip_id, hcd_image_t *img)
+{
+	char path[HCD_PATH_LEN], line[HCD_NAME_LEN + SHA256_HEX_LEN + 8];
+	unsigned char digest[SHA256_LEN];
+	char hex[SHA256_HEX_LEN];
+	fw_store_entry_t e, cur;
+	sha256_t c;
+	FILE *fp;
+	int found = 0, m;
+
+	snprintf(path, sizeof(path), "%s/%s", store, FW_STORE_MANIFEST);
+	if ((fp = fopen(path, "r")) == NULL) {
+		return(-1);
+	}
+
+	/* The exact name, else the highest version of the chip */
+	while (found < 2 && fgets(line, sizeof(line), fp) != NULL) {
+		if (fw_store_parse(line, &cur) < 0
+				|| (m = fw_store_match(cur.chip_id, chip_id)) == 0) {
+			continue;
+		}
+
+		if (m > found || hcd_version_cmp(
+				strchr(cur.chip_id, '_') + 1,
+				strchr(e.chip_id, '_') + 1) > 0) {
+			e = cur;
+			found = m;
+		}
+	}
+
+	fclose(fp);
+
+	if (!found) {
+		errno = ENOENT;
+		return(-1);
+	}
+
+	fw_store_object(store, e.hash, path, sizeof(path));
+	if (hcd_map(path, img) < 0) {
+		log2file("can't map %s for %s, error %d\n", path, chip_id,
+			errno);
+		return(-1);
+	}
+
+	/* Pages other instances have read are hashed from the page cache */
+	sha256_init(&c);
+	sha256_update(&c, img->data, img->len);
+	sha256_final(&c, digest);
+	sha256_hex(digest, hex);
+
+	if (strcmp(hex, e.hash) != 0) {
+		log2file("object %s is corrupt, its content hashes to %s\n",
+			path, hex);
+		hcd_unmap(img);
+		errno = EIO;
+		return(-1);
+	}
+
+	snprintf(img->name, sizeof(img->name), "%s", e.chip_id);
+
+	return(0);
+}
+
+int
+fw_store_create(const char *store)
+{
+	char path[HCD_PATH_LEN];
+
+	snprintf(path, sizeof(path), "%s/%s", store, FW_STORE_OBJECTS);
+
+	if ((mkdir(store, 0755) < 0 && errno != EEXIST)
+			|| (mkdir(path, 0755) < 0 && errno != EEXIST)) {
+		return(-1);
+	}
+
+	return(0);
+}
+
+/* Write a file's data through before it is renamed into view */
+static int
+fw_store_sync(const char *path, int flags)
+{
+	int fd, ret;
+
+	if ((fd = open(path, flags)) < 0) {
+		return(-1);
+	}
+
+	ret = fsync(fd);
+	close(fd);
+
+	return(ret);
+}
+
+int
+fw_store_put(const char *store, const char *hash, const char *tmp)
+{
+	char path[HCD_PATH_LEN];
+
+	fw_store_object(store, hash, path, sizeof(path));
+
+	/* Same name, same content: one copy is enough */
+	if (access(path, F_OK) == 0) {
+		unlink(tmp);
+		return(0);
+	}
+
+	if (fw_store_sync(tmp, O_RDONLY) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return(-1);
+	}
+
+	return(0);
+}
+
+/* Entries of the current manifest that e does not replace */
+static void
+fw_store_keep(const char *store, const fw_store_entry_t *e, int n, FILE *out)
+{
+	char path[HCD_PATH_LEN], line[HCD_NAME_LEN + SHA256_HEX_LEN + 8];
+	fw_store_entry_t old;
+	FILE *fp;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s", store, FW_STORE_MANIFEST);
+	if ((fp = fopen(path, "r")) == NULL) {
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (fw_store_parse(line, &old) < 0) {
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (strcasecmp(e[i].chip_id, old.chip_id) == 0) {
+				break;
+			}
+		}
+
+		if (i == n) {
+			fprintf(out, "%s\t%s\n", old.chip_id, old.hash);
+		}
+	}
+
+	fclose(fp);
+}
+
+int
+fw_store_update(const char *store, const fw_store_entry_t *e, int n)
+{
+	char path[HCD_PATH_LEN], tmp[HCD_PATH_LEN + 16];
+	FILE *fp;
+	int i, lock, ret = -1;
+
+	if (fw_store_create(store) < 0) {
+		return(-1);
+	}
+
+	/* The directory itself is the lock between updaters */
+	if ((lock = open(store, O_RDONLY | O_DIRECTORY)) < 0) {
+		return(-1);
+	}
+
+	if (flock(lock, LOCK_EX) < 0) {
+		close(lock);
+		return(-1);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", store, FW_STORE_MANIFEST);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		goto out;
+	}
+
+	fprintf(fp, "# chip_id\tsha256\n");
+	fw_store_keep(store, e, n, fp);
+
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%s\t%s\n", e[i].chip_id, e[i].hash);
+	}
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		goto out;
+	}
+
+	/* Make the rename itself durable */
+	fsync(lock);
+	ret = 0;
+
+out:
+	flock(lock, LOCK_UN);
+	close(lock);
+
+	return(ret);
+}
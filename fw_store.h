@@ -0,0 +1,71 @@
+/*****************************************************************************
+**
+**  Name:          fw_store.h
+**
+**  Description:   Content-addressed firmware store.
+**
+**                 A store is a directory holding every image once, as
+**                 objects/<sha256>.hcd, and a manifest of
+**                 "chip_id<TAB>sha256" lines naming the image each chip
+**                 takes.  Modules sharing an image share its object.
+**
+**                 Objects are plain HCD records, never compressed, so
+**                 every bring-up instance maps the same file read-only and
+**                 they all use the same page cache pages instead of each
+**                 reading or inflating its own copy.  An object's name is
+**                 checked against its content when it is mapped.
+**
+**                 Objects are written under a temporary name and renamed
+**                 into place, then the manifest is rewritten and renamed
+**                 over the old one, so a reader sees either the old or the
+**                 new firmware, never a mix.  Objects are not removed when
+**                 the manifest stops naming them: a reader that read the
+**                 old manifest still finds its image.
+**
+******************************************************************************/
+
+#ifndef __FW_STORE__H__
+#define __FW_STORE__H__
+
+#include "hcd.h"
+#include "sha256.h"
+
+#define FW_STORE_MANIFEST	"manifest"
+#define FW_STORE_OBJECTS	"objects"
+
+typedef struct {
+	char chip_id[HCD_NAME_LEN];
+	char hash[SHA256_HEX_LEN];
+} fw_store_entry_t;
+
+/*
+ * Map the image the manifest of store names for chip_id (case-insensitive)
+ * into img and check it against its hash.  An entry named chip_id itself
+ * wins, else the highest version among entries named chip_id_<version>.
+ * Returns 0 on success, -1 with errno ENOENT when no entry matches.
+ */
+extern int fw_store_find(const char *store, const char *chip_id,
+	hcd_image_t *img);
+
+/* Path of the object with hash inside store */
+extern void fw_store_object(const char *store, const char *hash, char *path,
+	int len);
+
+/* Create store and its objects directory if they do not exist */
+extern int fw_store_create(const char *store);
+
+/*
+ * Make the file tmp, written inside the objects directory, the object
+ * with hash.  When the store already has it, tmp is just removed.
+ */
+extern int fw_store_put(const char *store, const char *hash, const char *tmp);
+
+/*
+ * Point the n chip ids of e at their objects, keeping the other entries
+ * of the manifest, and replace the manifest in one rename.  Concurrent
+ * updates of the same store are serialized.
+ */
+extern int fw_store_update(const char *store, const fw_store_entry_t *e,
+	int n);
+
+#endif
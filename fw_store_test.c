@@ -0,0 +1,148 @@
+/*****************************************************************************
+**
+**  Name:          fw_store_test.c
+**
+**  Description:   Build host check of firmware store lookups, run by make
+**                 test.
+**
+**                 A store is filled in a temporary directory the way
+**                 fw_compile -s fills one, with images named after their
+**                 files, versions included, and every lookup a chip can
+**                 make is checked: by the bare chip id, which must find
+**                 the highest version, by a full versioned name, in any
+**                 case, and for chips the store does not have.
+**
+**                 The exit status is 1 if any lookup went wrong.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "fw_store.h"
+
+static int failed;
+
+/* The library logs through the daemon's log2file() */
+void
+log2file(const char *fmt, ...)
+{
+}
+
+/* A one record image, told apart by its payload byte */
+static int
+put_image(const char *store, const char *chip_id, unsigned char tag,
+	fw_store_entry_t *e)
+{
+	const unsigned char rec[] = { 0x4c, 0xfc, 0x01, tag };
+	char tmp[HCD_PATH_LEN];
+	unsigned char digest[SHA256_LEN];
+	sha256_t c;
+	FILE *fp;
+
+	sha256_init(&c);
+	sha256_update(&c, rec, sizeof(rec));
+	sha256_final(&c, digest);
+
+	snprintf(e->chip_id, sizeof(e->chip_id), "%s", chip_id);
+	sha256_hex(digest, e->hash);
+
+	snprintf(tmp, sizeof(tmp), "%s/%s/%02x.tmp", store, FW_STORE_OBJECTS,
+		tag);
+	if ((fp = fopen(tmp, "w")) == NULL
+			|| fwrite(rec, sizeof(rec), 1, fp) != 1
+			|| fclose(fp) != 0) {
+		return(-1);
+	}
+
+	return(fw_store_put(store, e->hash, tmp));
+}
+
+/* chip_id must find the image tagged tag, or nothing when tag is 0 */
+static void
+check(const char *store, const char *chip_id, unsigned char tag)
+{
+	hcd_image_t img;
+	int ret;
+
+	ret = fw_store_find(store, chip_id, &img);
+
+	if (tag == 0) {
+		if (ret == 0 || errno != ENOENT) {
+			printf("FAIL %s: found %s, expected nothing\n", chip_id,
+				ret == 0 ? img.name : "an error");
+			failed++;
+		}
+		if (ret == 0) {
+			hcd_unmap(&img);
+		}
+		return;
+	}
+
+	if (ret < 0) {
+		printf("FAIL %s: not found, error %d\n", chip_id, errno);
+		failed++;
+		return;
+	}
+
+	if (img.len != 4 || img.data[3] != tag) {
+		printf("FAIL %s: found %s, not image %02x\n", chip_id, img.name,
+			tag);
+		failed++;
+	}
+
+	hcd_unmap(&img);
+}
+
+static void
+cleanup(const char *store)
+{
+	char cmd[HCD_PATH_LEN + 16];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", store);
+	if (system(cmd) != 0) {
+		fprintf(stderr, "fw_store_test: %s left behind\n", store);
+	}
+}
+
+int
+main(void)
+{
+	char store[] = "/tmp/fw_store_test.XXXXXX";
+	fw_store_entry_t e[4];
+
+	if (mkdtemp(store) == NULL || fw_store_create(store) < 0) {
+		fprintf(stderr, "fw_store_test: no temporary store\n");
+		return(2);
+	}
+
+	/* Versions compare by number, not as text: 1000 is the highest */
+	if (put_image(store, "BCM4345C0_003.001.025.200", 0x66, &e[0]) < 0
+			|| put_image(store, "BCM4345C0_003.001.025.0187", 0x87,
+				&e[1]) < 0
+			|| put_image(store, "BCM4345C0_003.001.025.1000", 0x10,
+				&e[2]) < 0
+			|| put_image(store, "BCM43438A1", 0x38, &e[3]) < 0
+			|| fw_store_update(store, e, 4) < 0) {
+		fprintf(stderr, "fw_store_test: can't fill %s\n", store);
+		cleanup(store);
+		return(2);
+	}
+
+	check(store, "BCM4345C0", 0x10);
+	check(store, "bcm4345c0", 0x10);
+	check(store, "BCM4345C0_003.001.025.0187", 0x87);
+	check(store, "BCM43438A1", 0x38);
+	check(store, "BCM4345", 0);
+	check(store, "BCM4345C0_003", 0);
+	check(store, "BCM43438A1_001", 0);
+
+	cleanup(store);
+
+	printf("store lookups: %d wrong\n", failed);
+
+	return(failed ? 1 : 0);
+}
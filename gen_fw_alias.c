@@ -0,0 +1,159 @@
+/*****************************************************************************
+**
+**  Name:          gen_fw_alias.c
+**
+**  Description:   Build host tool that compiles fw_aliases.txt into the
+**                 minimal perfect hash table of fw_alias_table.h.
+**
+**                 It is invoked from the Makefile in the form
+**						gen_fw_alias fw_aliases.txt > fw_alias_table.h
+**
+**                 and fails the build when the rules contain duplicate
+**                 keys or do not hash back to their own slots.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fw_phash.h"
+
+#define MAX_RULES	256
+#define ID_LEN		32
+
+typedef struct {
+	char key[ID_LEN];
+	char updated_chip_id[ID_LEN];
+	char comment[64];
+	int slot;
+} rule_t;
+
+static rule_t rules[MAX_RULES];
+
+static int
+read_rules(const char *path)
+{
+	char line[256], id[ID_LEN], *p;
+	rule_t *r;
+	FILE *fp;
+	int n = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "gen_fw_alias: can't open %s\n", path);
+		return(-1);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		r = &rules[n];
+
+		if ((p = strchr(line, '#')) != NULL) {
+			*p++ = 0;
+			p[strcspn(p, "\r\n")] = 0;
+			p += strspn(p, " \t");
+		}
+
+		if (sscanf(line, "%31s %31s", id, r->updated_chip_id) != 2) {
+			continue;
+		}
+
+		if (n == MAX_RULES) {
+			fprintf(stderr, "gen_fw_alias: too many rules\n");
+			fclose(fp);
+			return(-1);
+		}
+
+		fw_phash_chip_key(id, r->key, sizeof(r->key));
+		snprintf(r->comment, sizeof(r->comment), "%s", p ? p : "");
+		n++;
+	}
+
+	fclose(fp);
+
+	return(n);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *keys[MAX_RULES];
+	unsigned short disp[MAX_RULES];
+	int order[MAX_RULES];
+	int slot[MAX_RULES];
+	int lens[ID_LEN];
+	int n, nb, i, j;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s fw_aliases.txt\n", argv[0]);
+		return(1);
+	}
+
+	if ((n = read_rules(argv[1])) <= 0) {
+		fprintf(stderr, "gen_fw_alias: no rules in %s\n", argv[1]);
+		return(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		keys[i] = rules[i].key;
+
+		for (j = 0; j < i; j++) {
+			if (strcmp(keys[i], keys[j]) == 0) {
+				fprintf(stderr, "gen_fw_alias: duplicate key %s\n",
+					keys[i]);
+				return(1);
+			}
+		}
+	}
+
+	if (fw_phash_build(keys, n, disp, slot) < 0) {
+		fprintf(stderr, "gen_fw_alias: no perfect hash found\n");
+		return(1);
+	}
+
+	nb = fw_phash_nbuckets(n);
+	memset(lens, 0, sizeof(lens));
+
+	for (i = 0; i < n; i++) {
+		if (fw_phash_slot(disp, n, keys[i], strlen(keys[i])) != slot[i]) {
+			fprintf(stderr, "gen_fw_alias: %s does not hash back\n",
+				keys[i]);
+			return(1);
+		}
+
+		order[slot[i]] = i;
+		lens[strlen(keys[i])] = 1;
+	}
+
+	printf("/* Generated by gen_fw_alias from %s, do not edit */\n\n",
+		argv[1]);
+	printf("#define FW_ALIAS_NRULES\t%d\n\n", n);
+
+	printf("static const unsigned short fw_alias_disp[%d] = {", nb);
+	for (i = 0; i < nb; i++) {
+		printf("%s%s%u", i ? "," : "", i % 8 ? " " : "\n\t", disp[i]);
+	}
+	printf("\n};\n\n");
+
+	printf("static const fw_alias_rule_t fw_alias_rules[%d] = {\n", n);
+	for (i = 0; i < n; i++) {
+		j = order[i];
+		printf("\t{ \"%s\", \"%s\" },", rules[j].key,
+			rules[j].updated_chip_id);
+		if (rules[j].comment[0]) {
+			printf("\t/* %s */", rules[j].comment);
+		}
+		printf("\n");
+	}
+	printf("};\n\n");
+
+	/* Key lengths to probe, longest first, zero terminated */
+	printf("static const unsigned char fw_alias_key_lens[] = {");
+	for (i = ID_LEN - 1; i > 0; i--) {
+		if (lens[i]) {
+			printf(" %d,", i);
+		}
+	}
+	printf(" 0 };\n");
+
+	return(0);
+}
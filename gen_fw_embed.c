@@ -0,0 +1,104 @@
+/*****************************************************************************
+**
+**  Name:          gen_fw_embed.c
+**
+**  Description:   Build host tool that links HCD images into the binary.
+**
+**                 It is invoked from the Makefile in the form
+**						gen_fw_embed BCM43438A1.hcd ... > fw_embed_table.h
+**
+**                 Every image (raw or compressed) is parsed and validated
+**                 here, then emitted as const record bytes and a table of
+**                 record lengths, so the target downloads it without any
+**                 filesystem access and without parsing a record header.
+**                 With no arguments an empty table is emitted.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "hcd.h"
+
+void
+log2file(const char *fmt, ...)
+{
+	va_list vl;
+
+	va_start(vl, fmt);
+	vfprintf(stderr, fmt, vl);
+	va_end(vl);
+}
+
+static int
+emit_image(int n, const char *path, hcd_image_t *img)
+{
+	const unsigned char *rec;
+	size_t off = 0, i;
+	int len, col = 0;
+
+	if (hcd_map(path, img) < 0) {
+		fprintf(stderr, "gen_fw_embed: %s is not a usable HCD image\n",
+			path);
+		return(-1);
+	}
+
+	printf("/* %s */\n", path);
+	printf("static const unsigned char fw_embed_%d[] = {", n);
+
+	while ((rec = hcd_next_record(img, &off, &len)) != NULL) {
+		for (i = 0; i < (size_t)len; i++, col++) {
+			printf("%s0x%02x,", col % 12 ? " " : "\n\t", rec[i]);
+		}
+	}
+
+	printf("\n};\n\n");
+
+	/* Compressed images only know their size once fully inflated */
+	if (img->nrecords < 0 || off != img->len) {
+		fprintf(stderr, "gen_fw_embed: %s is truncated\n", path);
+		return(-1);
+	}
+
+	printf("static const unsigned short fw_embed_%d_lens[] = {", n);
+
+	for (off = 0, col = 0; hcd_next_record(img, &off, &len) != NULL;
+			col++) {
+		printf("%s%d,", col % 12 ? " " : "\n\t", len);
+	}
+
+	printf("\n};\n\n");
+
+	return(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	hcd_image_t *img;
+	int i;
+
+	if ((img = calloc(argc, sizeof(*img))) == NULL) {
+		return(1);
+	}
+
+	printf("/* Generated by gen_fw_embed, do not edit */\n\n");
+
+	for (i = 1; i < argc; i++) {
+		if (emit_image(i, argv[i], &img[i]) < 0) {
+			return(1);
+		}
+	}
+
+	printf("static const fw_embed_image_t fw_embed_images[] = {\n");
+	for (i = 1; i < argc; i++) {
+		printf("\t{ \"%s\", fw_embed_%d, sizeof(fw_embed_%d), "
+			"fw_embed_%d_lens, %d },\n", img[i].name, i, i, i,
+			img[i].nrecords);
+		hcd_unmap(&img[i]);
+	}
+	printf("\t{ NULL, NULL, 0, NULL, 0 }\n};\n");
+
+	return(0);
+}
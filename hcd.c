@@ -0,0 +1,248 @@
+/*****************************************************************************
+**
+**  Name:          hcd.c
+**
+**  Description:   Mapping and record iteration for HCD patchram files.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "hcd.h"
+
+extern void log2file(const char *fmt, ...);
+
+static const struct {
+	const char *ext;
+	int type;
+} hcd_exts[] = {
+	{ ".hcd", HCD_RAW },
+	{ ".hcd.lz4", HCD_LZ4 },
+#ifdef HAVE_ZSTD
+	{ ".hcd.zst", HCD_ZSTD },
+#endif
+	{ NULL, 0 }
+};
+
+int
+hcd_file_type(const char *name, int *base_len)
+{
+	int i, len = strlen(name), n;
+
+	for (i = 0; hcd_exts[i].ext; i++) {
+		n = strlen(hcd_exts[i].ext);
+
+		if (len > n && strcasecmp(name + len - n, hcd_exts[i].ext) == 0) {
+			*base_len = len - n;
+			return(hcd_exts[i].type);
+		}
+	}
+
+	return(-1);
+}
+
+int
+hcd_version_cmp(const char *a, const char *b)
+{
+	unsigned long x, y;
+	char *ea, *eb;
+
+	while (*a || *b) {
+		x = strtoul(a, &ea, 10);
+		y = strtoul(b, &eb, 10);
+
+		if (x != y) {
+			return(x < y ? -1 : 1);
+		}
+
+		if (ea == a || eb == b) {
+			return(strcmp(a, b));
+		}
+
+		a = *ea == '.' ? ea + 1 : ea;
+		b = *eb == '.' ? eb + 1 : eb;
+	}
+
+	return(0);
+}
+
+int
+hcd_validate(const unsigned char *data, size_t len)
+{
+	size_t off = 0;
+	int n = 0;
+
+	while (off < len) {
+		if (len - off < HCD_RECORD_HDR_LEN) {
+			return(-1);
+		}
+
+		off += HCD_RECORD_HDR_LEN + data[off + 2];
+
+		if (off > len) {
+			return(-1);
+		}
+
+		n++;
+	}
+
+	return(n);
+}
+
+static void
+hcd_set_name(hcd_image_t *img, const char *path)
+{
+	const char *base;
+	int i, len;
+
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+
+	if (hcd_file_type(base, &len) < 0) {
+		len = strlen(base);
+	}
+
+	for (i = 0; i < HCD_NAME_LEN - 1 && i < len; i++) {
+		img->name[i] = toupper((unsigned char)base[i]);
+	}
+
+	img->name[i] = 0;
+}
+
+int
+hcd_map(const char *path, hcd_image_t *img)
+{
+	struct stat st;
+	void *p;
+	int fd, base;
+
+	memset(img, 0, sizeof(*img));
+
+	if ((img->type = hcd_file_type(path, &base)) < 0) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		return(-1);
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return(-1);
+	}
+
+	/* Populate now so the page-in cost is paid off the download path */
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		return(-1);
+	}
+
+	strncpy(img->path, path, HCD_PATH_LEN - 1);
+	hcd_set_name(img, path);
+
+	if (img->type != HCD_RAW) {
+		if (hcd_stream_open(img, p, st.st_size) < 0) {
+			log2file("file %s is not a valid compressed image\n", path);
+			munmap(p, st.st_size);
+			errno = EINVAL;
+			return(-1);
+		}
+
+		return(0);
+	}
+
+	img->data = p;
+	img->len = st.st_size;
+	img->nrecords = hcd_validate(img->data, img->len);
+
+	if (img->nrecords < 0) {
+		log2file("file %s is not a valid HCD image\n", path);
+		hcd_unmap(img);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	return(0);
+}
+
+void
+hcd_start(hcd_image_t *img)
+{
+	if (img->stream) {
+		hcd_stream_start(img);
+	}
+}
+
+void
+hcd_unmap(hcd_image_t *img)
+{
+	if (img->stream) {
+		hcd_stream_close(img);
+	} else if (img->data && img->type != HCD_BUILTIN) {
+		munmap((void *)img->data, img->len);
+	}
+
+	img->data = NULL;
+	img->len = 0;
+	img->nrecords = 0;
+}
+
+/* Make sure the first need bytes of the image are there */
+static int
+hcd_available(hcd_image_t *img, size_t need)
+{
+	if (need <= img->len) {
+		return(1);
+	}
+
+	return(img->stream != NULL && hcd_stream_wait(img, need) >= need);
+}
+
+const unsigned char *
+hcd_next_record(hcd_image_t *img, size_t *off, int *rec_len)
+{
+	const unsigned char *rec;
+
+	if (!hcd_available(img, *off + HCD_RECORD_HDR_LEN)) {
+		return(NULL);
+	}
+
+	rec = img->data + *off;
+	*rec_len = HCD_RECORD_HDR_LEN + rec[2];
+
+	if (!hcd_available(img, *off + *rec_len)) {
+		log2file("file %s ends inside a record\n", img->path);
+		return(NULL);
+	}
+
+	*off += *rec_len;
+
+	return(rec);
+}
+
+int
+hcd_check_end(hcd_image_t *img, size_t off)
+{
+	/* The end of a stream is only known once it stopped */
+	if (img->stream != NULL) {
+		hcd_stream_wait(img, (size_t)-1);
+		if (hcd_stream_status(img) != 1) {
+			return(-1);
+		}
+	}
+
+	return(off == img->len && img->nrecords >= 0 ? 0 : -1);
+}
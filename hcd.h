@@ -0,0 +1,92 @@
+/*****************************************************************************
+**
+**  Name:          hcd.h
+**
+**  Description:   Access to patchram files in the HCD format.
+**
+**                 An HCD file is a plain sequence of HCI command records,
+**                 each made of a little endian opcode, a one byte
+**                 parameter length and the parameters themselves.  Images
+**                 are mapped read-only and validated once so the download
+**                 loop only has to walk memory.
+**
+**                 Images stored as .hcd.lz4 (or .hcd.zst when built with
+**                 FW_ZSTD=1) are decompressed by a pipeline thread; the
+**                 record iterator only waits when it catches up with it.
+**
+******************************************************************************/
+
+#ifndef __HCD__H__
+#define __HCD__H__
+
+#include <stddef.h>
+
+#define HCD_NAME_LEN		64
+#define HCD_PATH_LEN		1024
+#define HCD_RECORD_HDR_LEN	3
+
+#define HCD_RAW			0
+#define HCD_LZ4			1
+#define HCD_ZSTD		2
+#define HCD_BUILTIN		3	/* linked in, see fw_embed.c */
+
+struct hcd_stream;
+
+typedef struct {
+	char name[HCD_NAME_LEN];	/* upper case file name, no extension */
+	char path[HCD_PATH_LEN];
+	const unsigned char *data;
+	size_t len;			/* bytes of data available so far */
+	int nrecords;			/* -1 while still decompressing */
+	int type;
+	struct hcd_stream *stream;
+	const unsigned short *rec_lens;	/* built in: each record's length */
+} hcd_image_t;
+
+/*
+ * Return the storage type of an HCD file name (HCD_RAW, HCD_LZ4 or
+ * HCD_ZSTD), or -1 if it is not one.  *base_len is set to the length of
+ * the name without its extensions.
+ */
+extern int hcd_file_type(const char *name, int *base_len);
+
+/*
+ * Compare the dotted version tuples of two image names
+ * ("003.001.025.0187") numerically, <0, 0 or >0 like strcmp()
+ */
+extern int hcd_version_cmp(const char *a, const char *b);
+
+/* Validate the record framing of an image, returns the record count or -1 */
+extern int hcd_validate(const unsigned char *data, size_t len);
+
+/* Map and validate an HCD file, returns 0 on success */
+extern int hcd_map(const char *path, hcd_image_t *img);
+
+/* Start decompressing a compressed image ahead of its first use */
+extern void hcd_start(hcd_image_t *img);
+
+extern void hcd_unmap(hcd_image_t *img);
+
+/*
+ * Return the record at *off (pointing at its 3 byte header) and advance
+ * *off past it.  Returns NULL at the end of the image.
+ */
+extern const unsigned char *hcd_next_record(hcd_image_t *img,
+	size_t *off, int *rec_len);
+
+/*
+ * Once hcd_next_record() returned NULL: 0 if the records ended where the
+ * image does, -1 if it stopped early (a truncated image, or one that
+ * failed to decompress).
+ */
+extern int hcd_check_end(hcd_image_t *img, size_t off);
+
+/* Decompression pipeline, see hcd_stream.c */
+extern int hcd_stream_open(hcd_image_t *img, const unsigned char *src,
+	size_t src_len);
+extern void hcd_stream_start(hcd_image_t *img);
+extern size_t hcd_stream_wait(hcd_image_t *img, size_t need);
+extern int hcd_stream_status(hcd_image_t *img);
+extern void hcd_stream_close(hcd_image_t *img);
+
+#endif
@@ -0,0 +1,439 @@
+/*****************************************************************************
+**
+**  Name:          hcd_stream.c
+**
+**  Description:   Decompression pipeline for compressed HCD images.
+**
+**                 A producer thread inflates the mapped .hcd.lz4 (or
+**                 .hcd.zst) file into an anonymous mapping and publishes
+**                 its progress every HCD_STREAM_CHUNK bytes.  The download
+**                 loop consumes records behind it and only blocks when it
+**                 catches up, which at UART line rates it practically
+**                 never does.
+**
+**                 LZ4 frames are decoded here so static builds need no
+**                 extra library.  Block and content checksums are not
+**                 verified; the HCD record framing is checked instead.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "hcd.h"
+
+extern void log2file(const char *fmt, ...);
+
+#define HCD_STREAM_CHUNK	4096
+#define HCD_STREAM_MAX		(8 * 1024 * 1024)
+
+#define LZ4_FRAME_MAGIC		0x184D2204
+#define LZ4_FLG_BLOCK_CSUM	0x10
+#define LZ4_FLG_SIZE		0x08
+#define LZ4_FLG_CONTENT_CSUM	0x04
+#define LZ4_FLG_DICT_ID		0x01
+#define LZ4_BLOCK_RAW		0x80000000u
+#define LZ4_MIN_MATCH		4
+
+struct hcd_stream {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int started;
+	int abort;
+	int done;			/* 1 finished, -1 failed */
+	const unsigned char *src;
+	size_t src_len;
+	size_t hdr_len;			/* frame header to skip */
+	unsigned char *out;
+	size_t cap;
+	size_t pos;			/* producer write position */
+	size_t avail;			/* published to the consumer */
+};
+
+static unsigned int
+le32(const unsigned char *p)
+{
+	return(p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+}
+
+/* Hand the bytes produced so far to the consumer, returns 0 to go on */
+static int
+hcd_stream_publish(struct hcd_stream *s, int done)
+{
+	int abort;
+
+	pthread_mutex_lock(&s->lock);
+	s->avail = s->pos;
+	if (done) {
+		s->done = done;
+	}
+	abort = s->abort;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return(abort ? -1 : 0);
+}
+
+static int
+lz4_length(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+	unsigned char b;
+
+	if (*len != 15) {
+		return(0);
+	}
+
+	do {
+		if (*ip >= iend) {
+			return(-1);
+		}
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return(0);
+}
+
+/* Decode one LZ4 block; the whole output so far is its history window */
+static int
+lz4_block(struct hcd_stream *s, const unsigned char *ip, size_t n)
+{
+	const unsigned char *iend = ip + n;
+	size_t lit, ml, offset, published = s->pos;
+	unsigned char token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		lit = token >> 4;
+		if (lz4_length(&ip, iend, &lit) < 0
+				|| lit > (size_t)(iend - ip) || lit > s->cap - s->pos) {
+			return(-1);
+		}
+
+		memcpy(s->out + s->pos, ip, lit);
+		ip += lit;
+		s->pos += lit;
+
+		/* The last sequence of a block carries literals only */
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return(-1);
+		}
+
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		ml = token & 15;
+		if (offset == 0 || offset > s->pos
+				|| lz4_length(&ip, iend, &ml) < 0
+				|| ml + LZ4_MIN_MATCH > s->cap - s->pos) {
+			return(-1);
+		}
+
+		/* Matches may overlap their own output, copy forwards */
+		for (ml += LZ4_MIN_MATCH; ml; ml--, s->pos++) {
+			s->out[s->pos] = s->out[s->pos - offset];
+		}
+
+		if (s->pos - published >= HCD_STREAM_CHUNK) {
+			if (hcd_stream_publish(s, 0) < 0) {
+				return(-1);
+			}
+			published = s->pos;
+		}
+	}
+
+	return(hcd_stream_publish(s, 0));
+}
+
+static int
+lz4_header(struct hcd_stream *s)
+{
+	const unsigned char *p = s->src;
+	unsigned char flg;
+
+	if (s->src_len < 7 || le32(p) != LZ4_FRAME_MAGIC) {
+		return(-1);
+	}
+
+	flg = p[4];
+	if ((flg >> 6) != 1) {
+		return(-1);
+	}
+
+	s->hdr_len = 7;
+	if (flg & LZ4_FLG_SIZE) {
+		if (s->src_len < 15 || p[10] || p[11] || p[12] || p[13]) {
+			return(-1);
+		}
+		s->cap = le32(p + 6);
+		s->hdr_len += 8;
+	}
+
+	if (flg & LZ4_FLG_DICT_ID) {
+		return(-1);
+	}
+
+	return(s->hdr_len <= s->src_len ? 0 : -1);
+}
+
+static int
+lz4_frame(struct hcd_stream *s)
+{
+	const unsigned char *p = s->src + s->hdr_len;
+	const unsigned char *end = s->src + s->src_len;
+	unsigned char flg = s->src[4];
+	unsigned int bsize;
+	size_t n;
+
+	for (;;) {
+		if (end - p < 4) {
+			return(-1);
+		}
+
+		bsize = le32(p);
+		p += 4;
+
+		if (bsize == 0) {
+			return(0);
+		}
+
+		n = bsize & ~LZ4_BLOCK_RAW;
+		if (n > (size_t)(end - p)) {
+			return(-1);
+		}
+
+		if (bsize & LZ4_BLOCK_RAW) {
+			if (n > s->cap - s->pos) {
+				return(-1);
+			}
+			memcpy(s->out + s->pos, p, n);
+			s->pos += n;
+			if (hcd_stream_publish(s, 0) < 0) {
+				return(-1);
+			}
+		} else if (lz4_block(s, p, n) < 0) {
+			return(-1);
+		}
+
+		p += n;
+		if (flg & LZ4_FLG_BLOCK_CSUM) {
+			p += 4;
+		}
+	}
+}
+
+#ifdef HAVE_ZSTD
+static int
+zstd_frame(struct hcd_stream *s)
+{
+	ZSTD_inBuffer in = { s->src, s->src_len, 0 };
+	ZSTD_outBuffer out;
+	ZSTD_DStream *ds;
+	size_t ret = 1;
+
+	if ((ds = ZSTD_createDStream()) == NULL) {
+		return(-1);
+	}
+
+	ZSTD_initDStream(ds);
+
+	do {
+		out.dst = s->out + s->pos;
+		out.size = s->cap - s->pos;
+		if (out.size > HCD_STREAM_CHUNK) {
+			out.size = HCD_STREAM_CHUNK;
+		}
+		out.pos = 0;
+
+		ret = ZSTD_decompressStream(ds, &out, &in);
+		if (ZSTD_isError(ret)) {
+			break;
+		}
+
+		s->pos += out.pos;
+		if (hcd_stream_publish(s, 0) < 0) {
+			break;
+		}
+
+		/* Truncated input or output larger than reserved */
+		if (ret != 0 && out.pos == 0
+				&& (in.pos == in.size || out.size == 0)) {
+			break;
+		}
+	} while (ret != 0);
+
+	ZSTD_freeDStream(ds);
+
+	return(ret == 0 ? 0 : -1);
+}
+#endif
+
+static void *
+hcd_stream_thread(void *arg)
+{
+	hcd_image_t *img = arg;
+	struct hcd_stream *s = img->stream;
+	int ret = -1;
+
+	if (img->type == HCD_LZ4) {
+		ret = lz4_frame(s);
+	}
+#ifdef HAVE_ZSTD
+	else if (img->type == HCD_ZSTD) {
+		ret = zstd_frame(s);
+	}
+#endif
+
+	if (ret == 0 && hcd_validate(s->out, s->pos) < 0) {
+		ret = -1;
+	}
+
+	if (ret < 0 && !s->abort) {
+		log2file("file %s failed to decompress after %lu bytes\n",
+			img->path, (unsigned long)s->pos);
+	}
+
+	hcd_stream_publish(s, ret == 0 ? 1 : -1);
+
+	return(NULL);
+}
+
+int
+hcd_stream_open(hcd_image_t *img, const unsigned char *src, size_t src_len)
+{
+	struct hcd_stream *s;
+	void *out;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		return(-1);
+	}
+
+	s->src = src;
+	s->src_len = src_len;
+	s->cap = HCD_STREAM_MAX;
+
+	if (img->type == HCD_LZ4 && lz4_header(s) < 0) {
+		free(s);
+		return(-1);
+	}
+
+#ifdef HAVE_ZSTD
+	if (img->type == HCD_ZSTD) {
+		unsigned long long size = ZSTD_getFrameContentSize(src, src_len);
+
+		if (size == ZSTD_CONTENTSIZE_ERROR) {
+			free(s);
+			return(-1);
+		}
+		if (size != ZSTD_CONTENTSIZE_UNKNOWN && size < HCD_STREAM_MAX) {
+			s->cap = size;
+		}
+	}
+#endif
+
+	/* Reserve the output up front so it never moves under the reader */
+	out = mmap(NULL, s->cap ? s->cap : 1, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (out == MAP_FAILED) {
+		free(s);
+		return(-1);
+	}
+
+	s->out = out;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	img->stream = s;
+	img->data = s->out;
+	img->len = 0;
+	img->nrecords = -1;
+
+	return(0);
+}
+
+void
+hcd_stream_start(hcd_image_t *img)
+{
+	struct hcd_stream *s = img->stream;
+
+	/* Running, or already run inline */
+	if (s->started || s->done) {
+		return;
+	}
+
+	if (pthread_create(&s->thread, NULL, hcd_stream_thread, img) != 0) {
+		/* Inflate inline instead, the reader just waits longer */
+		hcd_stream_thread(img);
+		return;
+	}
+
+	s->started = 1;
+}
+
+/* 1 once fully inflated, -1 if that failed, 0 while it goes on */
+int
+hcd_stream_status(hcd_image_t *img)
+{
+	struct hcd_stream *s = img->stream;
+	int done;
+
+	pthread_mutex_lock(&s->lock);
+	done = s->done;
+	pthread_mutex_unlock(&s->lock);
+
+	return(done);
+}
+
+size_t
+hcd_stream_wait(hcd_image_t *img, size_t need)
+{
+	struct hcd_stream *s = img->stream;
+
+	hcd_stream_start(img);
+
+	pthread_mutex_lock(&s->lock);
+	while (s->avail < need && !s->done) {
+		pthread_cond_wait(&s->cond, &s->lock);
+	}
+	img->len = s->avail;
+	if (s->done == 1 && img->nrecords < 0) {
+		img->nrecords = hcd_validate(s->out, s->avail);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return(img->len);
+}
+
+void
+hcd_stream_close(hcd_image_t *img)
+{
+	struct hcd_stream *s = img->stream;
+
+	if (s->started) {
+		pthread_mutex_lock(&s->lock);
+		s->abort = 1;
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, NULL);
+	}
+
+	munmap(s->out, s->cap ? s->cap : 1);
+	munmap((void *)s->src, s->src_len);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+
+	img->stream = NULL;
+}
@@ -0,0 +1,317 @@
+/*****************************************************************************
+**
+**  Name:          hci_replay.c
+**
+**  Description:   Build host tool that plays a controller back from a trace.
+**
+**                 It is invoked in the form
+**						hci_replay [-s scale] [-l link] trace_file
+**
+**                 where trace_file was written by brcm_patchram_plus
+**                 --trace on the device.  The controller side of the
+**                 session is played on a pty, whose name is printed (and
+**                 linked to link), so brcm_patchram_plus can be run
+**                 against it on a workstation:
+**
+**                     hci_replay -l /tmp/bt.tty bringup.trace &
+**                     brcm_patchram_plus --patchram fw/ /tmp/bt.tty
+**
+**                 Every command in the trace is waited for and compared
+**                 with what arrives; what the controller sent after it is
+**                 written back as many microseconds after the command's
+**                 arrival as it came after the command in the trace,
+**                 times scale (1 by default, 0 for no delays at all).
+**                 Latencies therefore stay those of the device, wire time
+**                 at its baud rates included, whatever the host's own
+**                 speed.  Commands that differ are reported and answered
+**                 anyway.
+**
+**                 The exit status is 1 if any command differed, 2 when
+**                 the host stopped or the trace is unusable.
+**
+******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+
+#define REPLAY_PKT_LEN		(1 + 3 + 255)
+#define REPLAY_WAIT_MS		30000	/* for the host's next command */
+#define REPLAY_MAX_REPORTS	8	/* differing commands printed */
+
+typedef struct {
+	long us;			/* since the first packet */
+	int out;			/* a command from the host */
+	unsigned char data[REPLAY_PKT_LEN];
+	int len;
+} replay_pkt_t;
+
+static replay_pkt_t *pkts;
+static int npkts;
+
+static int
+read_trace(const char *path)
+{
+	char line[4 * REPLAY_PKT_LEN], dir, *p;
+	replay_pkt_t *e;
+	unsigned int b;
+	FILE *fp;
+	int n, cap = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return(-1);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+
+		if (npkts == cap) {
+			cap = cap ? 2 * cap : 256;
+			if ((e = realloc(pkts, cap * sizeof(*e))) == NULL) {
+				fclose(fp);
+				return(-1);
+			}
+			pkts = e;
+		}
+
+		e = &pkts[npkts];
+		if (sscanf(line, "%ld %c%n", &e->us, &dir, &n) != 2
+				|| (dir != '>' && dir != '<')) {
+			continue;
+		}
+
+		e->out = dir == '>';
+		e->len = 0;
+		for (p = line + n; e->len < REPLAY_PKT_LEN
+				&& sscanf(p, " %2x%n", &b, &n) == 1; p += n) {
+			e->data[e->len++] = b;
+		}
+
+		npkts += e->len > 0;
+	}
+
+	fclose(fp);
+
+	return(0);
+}
+
+static long
+us_since(const struct timespec *t0)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return((now.tv_sec - t0->tv_sec) * 1000000L
+		+ (now.tv_nsec - t0->tv_nsec) / 1000);
+}
+
+/* Read exactly len bytes from the host, 0 when it stops sending */
+static int
+read_host(int fd, unsigned char *p, int len)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (len > 0) {
+		if (poll(&pfd, 1, REPLAY_WAIT_MS) <= 0) {
+			return(0);
+		}
+
+		if ((n = read(fd, p, len)) < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			return(0);
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return(1);
+}
+
+/* An H4 command: type byte, opcode, length and parameters */
+static int
+read_command(int fd, unsigned char *pkt)
+{
+	if (!read_host(fd, pkt, 4)) {
+		return(-1);
+	}
+
+	if (pkt[0] != 0x01) {
+		fprintf(stderr, "hci_replay: packet type 0x%02x from the host\n",
+			pkt[0]);
+		return(-1);
+	}
+
+	if (!read_host(fd, pkt + 4, pkt[3])) {
+		return(-1);
+	}
+
+	return(4 + pkt[3]);
+}
+
+static void
+report(int i, const unsigned char *pkt, int len)
+{
+	const replay_pkt_t *e = &pkts[i];
+
+	fprintf(stderr, "hci_replay: packet %d: opcode 0x%04x, %d bytes, "
+		"the trace has 0x%04x, %d bytes\n", i + 1,
+		len >= 3 ? pkt[1] | pkt[2] << 8 : 0, len,
+		e->len >= 3 ? e->data[1] | e->data[2] << 8 : 0, e->len);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: hci_replay [-s scale] [-l link] trace_file\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char pkt[REPLAY_PKT_LEN];
+	struct timespec t0, t_cmd, due;
+	struct termios tio;
+	const char *link = NULL, *slave;
+	double scale = 1.0;
+	long cmd_us = 0, ns;
+	int c, i, master, peer, len, commands = 0, events = 0, differed = 0;
+
+	while ((c = getopt(argc, argv, "s:l:")) != -1) {
+		switch (c) {
+		case 's':
+			scale = atof(optarg);
+			break;
+		case 'l':
+			link = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1 || scale < 0) {
+		usage();
+	}
+
+	if (read_trace(argv[optind]) < 0 || npkts == 0) {
+		fprintf(stderr, "hci_replay: no packets in %s\n", argv[optind]);
+		return(2);
+	}
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+			|| grantpt(master) < 0 || unlockpt(master) < 0
+			|| (slave = ptsname(master)) == NULL) {
+		fprintf(stderr, "hci_replay: no pty, error %d\n", errno);
+		return(2);
+	}
+
+	/* Held open so the master does not hang up between host opens */
+	if ((peer = open(slave, O_RDWR | O_NOCTTY)) < 0
+			|| tcgetattr(peer, &tio) < 0) {
+		fprintf(stderr, "hci_replay: can't open %s, error %d\n", slave,
+			errno);
+		return(2);
+	}
+
+	cfmakeraw(&tio);
+	tcsetattr(peer, TCSANOW, &tio);
+
+	if (link != NULL) {
+		unlink(link);
+		if (symlink(slave, link) < 0) {
+			fprintf(stderr, "hci_replay: can't link %s, error %d\n",
+				link, errno);
+			return(2);
+		}
+	}
+
+	printf("%s: %d packets, controller on %s\n", argv[optind], npkts,
+		link ? link : slave);
+	fflush(stdout);
+
+	clock_gettime(CLOCK_MONOTONIC, &t_cmd);
+	t0 = t_cmd;
+
+	for (i = 0; i < npkts; i++) {
+		if (pkts[i].out) {
+			if ((len = read_command(master, pkt)) < 0) {
+				fprintf(stderr, "hci_replay: the host stopped "
+					"before packet %d of %d\n", i + 1,
+					npkts);
+				return(2);
+			}
+
+			/* What follows is timed from this arrival */
+			clock_gettime(CLOCK_MONOTONIC, &t_cmd);
+			cmd_us = pkts[i].us;
+
+			if (commands++ == 0) {
+				t0 = t_cmd;
+			}
+
+			if (len != pkts[i].len
+					|| memcmp(pkt, pkts[i].data, len) != 0) {
+				if (differed++ < REPLAY_MAX_REPORTS) {
+					report(i, pkt, len);
+				}
+			}
+			continue;
+		}
+
+		ns = (long)((pkts[i].us - cmd_us) * scale * 1000);
+		due.tv_sec = t_cmd.tv_sec + ns / 1000000000L;
+		due.tv_nsec = t_cmd.tv_nsec + ns % 1000000000L;
+		if (due.tv_nsec >= 1000000000L) {
+			due.tv_sec++;
+			due.tv_nsec -= 1000000000L;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due,
+				NULL) == EINTR)
+			;
+
+		if (write(master, pkts[i].data, pkts[i].len) != pkts[i].len) {
+			fprintf(stderr, "hci_replay: can't write packet %d, "
+				"error %d\n", i + 1, errno);
+			return(2);
+		}
+		events++;
+	}
+
+	ns = us_since(&t0);
+
+	/* Let the host read the last answer before the pty goes away */
+	tcdrain(master);
+	usleep(100000);
+
+	printf("%d commands, %d answers in %ldms, %ldms in the trace "
+		"(scale %g), %d commands differed\n", commands, events,
+		ns / 1000,
+		(pkts[npkts - 1].us - pkts[0].us) / 1000, scale, differed);
+
+	if (link != NULL) {
+		unlink(link);
+	}
+
+	return(differed ? 1 : 0);
+}
@@ -0,0 +1,36 @@
+/*****************************************************************************
+**
+**  Name:          log.c
+**
+**  Description:   Messages appended to the log file, see log.h.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "log.h"
+
+//{{ add by FriendlyARM
+int log2file_enabled = 1;
+const char *log2file_name = LOG_FILE_NAME;
+static void _log2file(const char* fmt, va_list vl)
+{
+        FILE* file_out;
+        file_out = fopen(log2file_name,"a+");
+        if (file_out == NULL) {
+                return;
+        }
+        vfprintf(file_out, fmt, vl);
+        fclose(file_out);
+}
+void log2file(const char *fmt, ...)
+{
+        if (log2file_enabled) {
+                va_list vl;
+                va_start(vl, fmt);
+                _log2file(fmt, vl);
+                va_end(vl);
+        }
+}
+//}}
@@ -0,0 +1,22 @@
+/*****************************************************************************
+**
+**  Name:          log.h
+**
+**  Description:   The log2file() the library and the command line write
+**                 their messages with.  Each message is appended to the
+**                 log file on its own, opening and closing it, so the log
+**                 survives a crash at any point of the bring-up.
+**
+******************************************************************************/
+
+#ifndef __LOG__H__
+#define __LOG__H__
+
+#define LOG_FILE_NAME "/tmp/brcm_patchram_plus.log"
+
+extern int log2file_enabled;		/* 0 drops every message */
+extern const char *log2file_name;	/* LOG_FILE_NAME by default */
+
+extern void log2file(const char *fmt, ...);
+
+#endif
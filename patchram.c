@@ -0,0 +1,1450 @@
+/*****************************************************************************
+**
+**  Name:          patchram.c
+**
+**  Description:   Non-blocking HCI exchange that resets the controller,
+**                 downloads its patchram and applies the configuration.
+**
+**                 The bring-up is a fixed sequence of steps.  Each step
+**                 either queues an HCI command and waits for its event,
+**                 waits for raw bytes or just waits for time to pass;
+**                 steps that do not apply are skipped.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "patchram.h"
+#include "fw_embed.h"
+#include "fw_store.h"
+
+extern void log2file(const char *fmt, ...);
+
+#define PATCHRAM_IDLE		0
+#define PATCHRAM_RUNNING	1
+#define PATCHRAM_FINISHED	2
+
+#define PATCHRAM_RESET_MS	4000
+#define PATCHRAM_DOWNLOAD_MS	1000	/* for a download command's answer */
+#define PATCHRAM_RECOVER_MS	500	/* for a reset after a failed one */
+
+#define HCI_EVT_CMD_CMPL_LOCAL_NAME_STRING	6
+
+typedef struct {
+	const char *name;
+	/* Queue the step, returns 0 when it does not apply */
+	int (*start)(patchram_t *pr);
+	/*
+	 * Handle the reply (none when the step expired), returns 0 to go
+	 * on, 1 to repeat the step, 2 to start the sequence over, -1
+	 */
+	int (*done)(patchram_t *pr);
+} patchram_step_t;
+
+static const unsigned char hci_reset[] = { 0x01, 0x03, 0x0c, 0x00 };
+
+static const unsigned char hci_read_local_name[] = { 0x01, 0x14, 0x0c, 0x00 };
+
+static const unsigned char hci_read_local_version[] = {
+	0x01, 0x01, 0x10, 0x00 };
+
+static const unsigned char hci_download_minidriver[] = {
+	0x01, 0x2e, 0xfc, 0x00 };
+
+static const unsigned char hci_update_baud_rate[] = { 0x01, 0x18, 0xfc, 0x06,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+static const unsigned char hci_write_bd_addr[] = { 0x01, 0x01, 0xfc, 0x06,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+static const unsigned char hci_write_sleep_mode[] = { 0x01, 0x27, 0xfc, 0x0c,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00,
+	0x00, 0x00 };
+
+static const unsigned char hci_write_sco_pcm_int[] =
+	{ 0x01, 0x1C, 0xFC, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+static const unsigned char hci_write_pcm_data_format[] =
+	{ 0x01, 0x1e, 0xFC, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+static const unsigned char hci_write_i2spcm_interface_param[] =
+	{ 0x01, 0x6d, 0xFC, 0x04, 0x00, 0x00, 0x00, 0x00 };
+
+typedef struct {
+	int baud_rate;
+	int termios_value;
+} tBaudRates;
+
+static const tBaudRates baud_rates[] = {
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+	{ 460800, B460800 },
+	{ 500000, B500000 },
+	{ 576000, B576000 },
+	{ 921600, B921600 },
+	{ 1000000, B1000000 },
+	{ 1152000, B1152000 },
+	{ 1500000, B1500000 },
+	{ 2000000, B2000000 },
+	{ 2500000, B2500000 },
+	{ 3000000, B3000000 },
+#ifndef __CYGWIN__
+	{ 3500000, B3500000 },
+	{ 4000000, B4000000 }
+#endif
+};
+
+void
+BRCM_encode_baud_rate(unsigned int baud_rate, unsigned char *encoded_baud)
+{
+	if(baud_rate == 0 || encoded_baud == NULL) {
+		log2file("Baudrate not supported!");
+		return;
+	}
+
+	encoded_baud[3] = (unsigned char)(baud_rate >> 24);
+	encoded_baud[2] = (unsigned char)(baud_rate >> 16);
+	encoded_baud[1] = (unsigned char)(baud_rate >> 8);
+	encoded_baud[0] = (unsigned char)(baud_rate & 0xFF);
+}
+
+int
+validate_baudrate(int baud_rate, int *value)
+{
+	unsigned int i;
+
+	for (i = 0; i < (sizeof(baud_rates) / sizeof(tBaudRates)); i++) {
+		if (baud_rates[i].baud_rate == baud_rate) {
+			*value = baud_rates[i].termios_value;
+			return(1);
+		}
+	}
+
+	return(0);
+}
+
+void
+patchram_dump(const unsigned char *out, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (i && !(i % 16)) {
+			log2file("\n");
+		}
+
+		log2file("%02x ", out[i]);
+	}
+
+	log2file("\n");
+}
+
+static long
+patchram_us(const struct timespec *from, const struct timespec *to)
+{
+	return((to->tv_sec - from->tv_sec) * 1000000L
+		+ (to->tv_nsec - from->tv_nsec) / 1000);
+}
+
+static void
+patchram_now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void
+patchram_arm(patchram_t *pr, long us)
+{
+	patchram_now(&pr->deadline);
+
+	pr->deadline.tv_sec += us / 1000000;
+	pr->deadline.tv_nsec += (us % 1000000) * 1000;
+
+	if (pr->deadline.tv_nsec >= 1000000000) {
+		pr->deadline.tv_sec++;
+		pr->deadline.tv_nsec -= 1000000000;
+	}
+}
+
+static void
+patchram_speed(patchram_t *pr, int speed)
+{
+	pr->tp.ops->speed(&pr->tp, speed);
+	pr->line_speed = speed;
+}
+
+/* Rate of a termios B* value */
+static int
+patchram_rate(int speed)
+{
+	unsigned int i;
+
+	for (i = 0; i < (sizeof(baud_rates) / sizeof(tBaudRates)); i++) {
+		if (baud_rates[i].termios_value == speed) {
+			return(baud_rates[i].baud_rate);
+		}
+	}
+
+	return(115200);
+}
+
+/* Opcode of the command in tx, behind its type byte */
+static int
+patchram_opcode(const patchram_t *pr)
+{
+	const unsigned char *p = pr->tx_iov[pr->tx_iovcnt - 1].iov_base;
+
+	if (pr->tx_iovcnt == 1) {
+		p++;
+	}
+
+	return(p[0] | p[1] << 8);
+}
+
+/* Why rx does not complete the command in tx, 0 if it does */
+static int
+patchram_check(const patchram_t *pr)
+{
+	int opcode = patchram_opcode(pr);
+
+	if (pr->rx_len == 0) {
+		return(PATCHRAM_FAIL_TIMEOUT);
+	}
+
+	if (pr->rx_len < 7 || pr->rx[1] != 0x0e || pr->rx[4] != (opcode & 0xff)
+			|| pr->rx[5] != opcode >> 8) {
+		return(PATCHRAM_FAIL_EVENT);
+	}
+
+	return(pr->rx[6] ? PATCHRAM_FAIL_STATUS : 0);
+}
+
+/*
+ * Note a failed download and have the sequence start over from a reset,
+ * to download at the next lower rate.  Returns what done() returns.
+ */
+static int
+patchram_download_failed(patchram_t *pr, int reason)
+{
+	static const char *reasons[] = { "", "timeout", "wrong event",
+		"error status" };
+	patchram_failure_t *f;
+	unsigned int i;
+
+	f = &pr->stats.failures[pr->stats.download_failures++];
+	f->reason = reason;
+	f->record = pr->fw_record;
+	f->offset = pr->fw_rec_off;
+	f->opcode = pr->tx_len ? patchram_opcode(pr) : 0;
+	f->status = reason == PATCHRAM_FAIL_STATUS ? pr->rx[6] : 0;
+	f->baudrate = patchram_rate(pr->line_speed);
+
+	log2file("download failed at record %d (offset %lu) at %d baud: %s\n",
+		f->record, f->offset, f->baudrate, reasons[reason]);
+
+	if (pr->stats.download_failures == PATCHRAM_DOWNLOAD_TRIES) {
+		pr->error = EIO;
+		return(-1);
+	}
+
+	for (i = 1; i < (sizeof(baud_rates) / sizeof(tBaudRates)); i++) {
+		if (baud_rates[i].termios_value == pr->download_speed) {
+			pr->download_speed = baud_rates[i - 1].termios_value;
+			break;
+		}
+	}
+
+	log2file("downloading again at %d baud\n",
+		patchram_rate(pr->download_speed));
+	pr->recovering = 1;
+
+	return(2);
+}
+
+/* Queue an HCI command and wait for its event */
+static int
+patchram_cmd(patchram_t *pr, const unsigned char *cmd, int len)
+{
+	memcpy(pr->tx, cmd, len);
+	pr->tx_len = len;
+	pr->tx_iov[0].iov_base = pr->tx;
+	pr->tx_iov[0].iov_len = len;
+	pr->tx_iovcnt = 1;
+
+	return(1);
+}
+
+static int
+patchram_open_fw(patchram_t *pr)
+{
+	fw_alias_resolve(pr->aliases, pr->chip_id, sizeof(pr->chip_id));
+
+	/* Built-in images need no filesystem, don't wait for the folder */
+	if (fw_embed_find(pr->chip_id, &pr->builtin) == 0) {
+		pr->image = &pr->builtin;
+	} else if (pr->fw_store[0]
+			&& fw_store_find(pr->fw_store, pr->chip_id,
+				&pr->stored) == 0) {
+		pr->image = &pr->stored;
+	} else {
+		pr->image = fw_prefetch_find(&pr->prefetch, pr->chip_id);
+
+		/* After a miss by version the name may still want one of them */
+		if (pr->image != NULL) {
+			fw_prefetch_release(&pr->prefetch, pr->image);
+		}
+	}
+
+	if (pr->image == NULL) {
+		log2file("no FW found for %s in %s\n", pr->chip_id,
+			pr->fw_folder);
+		pr->error = ENOENT;
+		return(-1);
+	}
+
+	/* Compressed images start inflating ahead of the download */
+	hcd_start(pr->image);
+	log2file("FW path = %s\n", pr->image->path);
+
+	return(0);
+}
+
+/* Reset a controller left in the minidriver by a failed download */
+static int
+start_recover(patchram_t *pr)
+{
+	if (!pr->recovering) {
+		return(0);
+	}
+
+	/* What is left of the failed exchange would only confuse the reset */
+	tcflush(pr->tp.fd, TCIFLUSH);
+	pr->expire_ms = PATCHRAM_RECOVER_MS;
+
+	return(patchram_cmd(pr, hci_reset, sizeof(hci_reset)));
+}
+
+static int
+done_recover(patchram_t *pr)
+{
+	pr->recovering = 0;
+
+	/* Unanswered, the controller is back at its default rate or lost */
+	if (pr->rx_len == 0 && pr->line_speed != B115200) {
+		patchram_speed(pr, B115200);
+	}
+
+	return(0);
+}
+
+static int
+start_reset(patchram_t *pr)
+{
+	pr->resend_ms = PATCHRAM_RESET_MS;
+
+	return(patchram_cmd(pr, hci_reset, sizeof(hci_reset)));
+}
+
+static int
+done_reset(patchram_t *pr)
+{
+	struct timespec now;
+
+	patchram_now(&now);
+	pr->stats.reset_us = patchram_us(&pr->t_step, &now);
+
+	return(0);
+}
+
+static int
+start_read_local_version(patchram_t *pr)
+{
+	/* A warm bring-up already knows the chip and its image */
+	if (pr->image != NULL) {
+		return(0);
+	}
+
+	memset(&pr->version, 0, sizeof(pr->version));
+
+	return(patchram_cmd(pr, hci_read_local_version,
+		sizeof(hci_read_local_version)));
+}
+
+/* Resolve the firmware by version, else leave it to the name */
+static int
+done_read_local_version(patchram_t *pr)
+{
+	const unsigned char *p = &pr->rx[7];
+	const char *name;
+
+	/* HCI version and revision, LMP version, manufacturer, subversion */
+	if (pr->rx_len < 7 + 8 || pr->rx[6] != 0) {
+		return(0);
+	}
+
+	pr->version.hci_rev = p[1] | p[2] << 8;
+	pr->version.manufacturer = p[4] | p[5] << 8;
+	pr->version.lmp_subver = p[6] | p[7] << 8;
+
+	log2file("manufacturer %d, HCI revision 0x%04x, LMP subversion 0x%04x\n",
+		pr->version.manufacturer, pr->version.hci_rev,
+		pr->version.lmp_subver);
+
+	if ((name = fw_chip_name(&pr->version)) == NULL) {
+		return(0);
+	}
+
+	snprintf(pr->chip_id, sizeof(pr->chip_id), "%s", name);
+	log2file("chip id = %s\n", pr->chip_id);
+
+	if (patchram_open_fw(pr) < 0) {
+		pr->error = 0;
+	}
+
+	return(0);
+}
+
+static int
+start_read_local_name(patchram_t *pr)
+{
+	/* A warm bring-up already knows the chip and its image */
+	if (pr->image != NULL) {
+		return(0);
+	}
+
+	return(patchram_cmd(pr, hci_read_local_name,
+		sizeof(hci_read_local_name)));
+}
+
+static int
+done_read_local_name(patchram_t *pr)
+{
+	const unsigned char *p = &pr->rx[1 + HCI_EVT_CMD_CMPL_LOCAL_NAME_STRING];
+	int i, n = pr->rx_len - (1 + HCI_EVT_CMD_CMPL_LOCAL_NAME_STRING);
+
+	for (i = 0; i < n && i < PATCHRAM_NAME_LEN - 1 && p[i] != 0; i++) {
+		pr->chip_id[i] = toupper(p[i]);
+	}
+
+	pr->chip_id[i] = 0;
+	log2file("chip id = %s\n", pr->chip_id);
+
+	return(patchram_open_fw(pr));
+}
+
+static int
+start_download_baudrate(patchram_t *pr)
+{
+	if (pr->download_speed == pr->line_speed) {
+		return(0);
+	}
+
+	patchram_cmd(pr, hci_update_baud_rate, sizeof(hci_update_baud_rate));
+	BRCM_encode_baud_rate(patchram_rate(pr->download_speed), &pr->tx[6]);
+
+	return(1);
+}
+
+static int
+done_download_baudrate(patchram_t *pr)
+{
+	patchram_speed(pr, pr->download_speed);
+
+	if (pr->debug) {
+		log2file("Done setting baudrate\n");
+	}
+
+	return(0);
+}
+
+static int
+done_baudrate(patchram_t *pr)
+{
+	patchram_speed(pr, pr->termios_baudrate);
+
+	if (pr->debug) {
+		log2file("Done setting baudrate\n");
+	}
+
+	return(0);
+}
+
+static int
+start_download_minidriver(patchram_t *pr)
+{
+	const void *lock_p[2];
+	size_t lock_len[2];
+
+	if (pr->image == NULL) {
+		return(0);
+	}
+
+	/* The records go out from the image, the events come into pr */
+	lock_p[0] = pr->image->data;
+	lock_len[0] = pr->image->len;
+	lock_p[1] = pr;
+	lock_len[1] = sizeof(*pr);
+	rt_enter(&pr->rt, lock_p, lock_len, 2);
+
+	patchram_now(&pr->t_download);
+	pr->fw_off = 0;
+	pr->fw_rec_off = 0;
+	pr->fw_record = -1;
+	pr->expire_ms = PATCHRAM_DOWNLOAD_MS;
+
+	return(patchram_cmd(pr, hci_download_minidriver,
+		sizeof(hci_download_minidriver)));
+}
+
+static int
+done_download_minidriver(patchram_t *pr)
+{
+	int reason;
+
+	if ((reason = patchram_check(pr)) != 0) {
+		return(patchram_download_failed(pr, reason));
+	}
+
+	return(0);
+}
+
+static int
+start_minidriver_ack(patchram_t *pr)
+{
+	/* Older chips send two extra bytes once the minidriver is up */
+	if (pr->image == NULL || pr->no2bytes || !pr->tp.ops->raw) {
+		return(0);
+	}
+
+	pr->rx_need = 2;
+	pr->expire_ms = PATCHRAM_DOWNLOAD_MS;
+
+	return(1);
+}
+
+static int
+done_minidriver_ack(patchram_t *pr)
+{
+	if (pr->rx_len < pr->rx_need) {
+		return(patchram_download_failed(pr, PATCHRAM_FAIL_TIMEOUT));
+	}
+
+	return(0);
+}
+
+static int
+start_settle(patchram_t *pr)
+{
+	if (pr->image == NULL || !pr->tosleep) {
+		return(0);
+	}
+
+	patchram_arm(pr, pr->tosleep);
+
+	return(1);
+}
+
+static int
+start_patchram(patchram_t *pr)
+{
+	const unsigned char *rec;
+	int len;
+
+	if (pr->image == NULL) {
+		return(0);
+	}
+
+	pr->fw_rec_off = pr->fw_off;
+
+	/* Built-in images come with their record lengths, nothing to parse */
+	if (pr->image->rec_lens != NULL) {
+		if (pr->fw_record + 1 >= pr->image->nrecords) {
+			return(0);
+		}
+		rec = pr->image->data + pr->fw_off;
+		len = pr->image->rec_lens[pr->fw_record + 1];
+		pr->fw_off += len;
+	} else if ((rec = hcd_next_record(pr->image, &pr->fw_off, &len))
+			== NULL) {
+		/* Launching a partial patch would pass for a good bring-up */
+		if (hcd_check_end(pr->image, pr->fw_off) < 0) {
+			log2file("FW %s is corrupt at offset %lu\n",
+				pr->image->path, (unsigned long)pr->fw_off);
+			pr->error = EIO;
+		}
+		return(0);
+	}
+
+	/* The record goes out from the image, behind the H4 type byte */
+	pr->tx[0] = 0x01;
+	pr->tx_iov[0].iov_base = pr->tx;
+	pr->tx_iov[0].iov_len = 1;
+	pr->tx_iov[1].iov_base = (void *)rec;
+	pr->tx_iov[1].iov_len = len;
+	pr->tx_iovcnt = 2;
+	pr->tx_len = len + 1;
+	pr->expire_ms = PATCHRAM_DOWNLOAD_MS;
+
+	return(1);
+}
+
+static int
+done_patchram(patchram_t *pr)
+{
+	int reason;
+
+	pr->fw_record++;
+
+	if ((reason = patchram_check(pr)) != 0) {
+		return(patchram_download_failed(pr, reason));
+	}
+
+	pr->stats.records++;
+
+	return(1);
+}
+
+static int
+start_launch_ram(patchram_t *pr)
+{
+	if (pr->image == NULL) {
+		return(0);
+	}
+
+	/* The patchram boots at the default rate */
+	if (pr->line_speed != B115200) {
+		patchram_speed(pr, B115200);
+	}
+
+	return(start_reset(pr));
+}
+
+static int
+done_launch_ram(patchram_t *pr)
+{
+	struct timespec now;
+
+	patchram_now(&now);
+	pr->stats.download_us = patchram_us(&pr->t_download, &now);
+	rt_leave(&pr->rt);
+
+	return(0);
+}
+
+static int
+start_baudrate(patchram_t *pr)
+{
+	if (!pr->termios_baudrate) {
+		return(0);
+	}
+
+	patchram_cmd(pr, hci_update_baud_rate, sizeof(hci_update_baud_rate));
+	BRCM_encode_baud_rate(pr->baudrate, &pr->tx[6]);
+
+	return(1);
+}
+
+static int
+start_bdaddr(patchram_t *pr)
+{
+	if (!pr->bdaddr_set) {
+		return(0);
+	}
+
+	patchram_cmd(pr, hci_write_bd_addr, sizeof(hci_write_bd_addr));
+	memcpy(&pr->tx[4], pr->bdaddr, sizeof(pr->bdaddr));
+
+	return(1);
+}
+
+static int
+start_enable_lpm(patchram_t *pr)
+{
+	if (!pr->enable_lpm) {
+		return(0);
+	}
+
+	return(patchram_cmd(pr, hci_write_sleep_mode,
+		sizeof(hci_write_sleep_mode)));
+}
+
+static int
+start_sco_pcm_int(patchram_t *pr)
+{
+	if (!pr->scopcm) {
+		return(0);
+	}
+
+	patchram_cmd(pr, hci_write_sco_pcm_int, sizeof(hci_write_sco_pcm_int));
+	memcpy(&pr->tx[4], pr->sco_pcm_int, sizeof(pr->sco_pcm_int));
+
+	return(1);
+}
+
+static int
+start_pcm_data_format(patchram_t *pr)
+{
+	if (!pr->scopcm) {
+		return(0);
+	}
+
+	patchram_cmd(pr, hci_write_pcm_data_format,
+		sizeof(hci_write_pcm_data_format));
+	memcpy(&pr->tx[4], pr->pcm_data_format, sizeof(pr->pcm_data_format));
+
+	return(1);
+}
+
+static int
+start_i2spcm_param(patchram_t *pr)
+{
+	if (!pr->i2s) {
+		return(0);
+	}
+
+	patchram_cmd(pr, hci_write_i2spcm_interface_param,
+		sizeof(hci_write_i2spcm_interface_param));
+	memcpy(&pr->tx[4], pr->i2spcm_param, sizeof(pr->i2spcm_param));
+
+	return(1);
+}
+
+static const patchram_step_t patchram_steps[] = {
+	{ "recover", start_recover, done_recover },
+	{ "reset", start_reset, done_reset },
+	{ "read_local_version", start_read_local_version,
+		done_read_local_version },
+	{ "read_local_name", start_read_local_name, done_read_local_name },
+	{ "download_baudrate", start_download_baudrate,
+		done_download_baudrate },
+	{ "download_minidriver", start_download_minidriver,
+		done_download_minidriver },
+	{ "minidriver_ack", start_minidriver_ack, done_minidriver_ack },
+	{ "settle", start_settle, NULL },
+	{ "patchram", start_patchram, done_patchram },
+	{ "launch_ram", start_launch_ram, done_launch_ram },
+	{ "baudrate", start_baudrate, done_baudrate },
+	{ "bd_addr", start_bdaddr, NULL },
+	{ "enable_lpm", start_enable_lpm, NULL },
+	{ "sco_pcm_int", start_sco_pcm_int, NULL },
+	{ "pcm_data_format", start_pcm_data_format, NULL },
+	{ "i2spcm_param", start_i2spcm_param, NULL },
+	{ NULL, NULL, NULL }
+};
+
+static int
+patchram_finish(patchram_t *pr, int error)
+{
+	struct timespec now;
+
+	pr->state = PATCHRAM_FINISHED;
+	pr->error = error;
+	pr->tx_len = 0;
+	pr->deadline.tv_sec = 0;
+
+	patchram_now(&now);
+	pr->stats.total_us = patchram_us(&pr->t_start, &now);
+	pr->stats.retransmits = pr->tp.h5.retransmits;
+	pr->stats.writes = pr->tp.txq.writes;
+	pr->stats.short_writes = pr->tp.txq.short_writes;
+	rt_leave(&pr->rt);
+	rt_unpin(&pr->rt);
+
+	if (pr->tp.ops->close) {
+		pr->tp.ops->close(&pr->tp);
+	}
+
+	if (pr->debug) {
+		log2file("bring-up %s in %ldus over %s: %u commands, "
+			"%u records, %lu bytes out in %u writes (%u short), "
+			"%lu in, %u resends, %u retransmits\n",
+			error ? "failed" : "done", pr->stats.total_us,
+			pr->tp.ops->name, pr->stats.commands,
+			pr->stats.records, pr->stats.tx_bytes,
+			pr->stats.writes, pr->stats.short_writes,
+			pr->stats.rx_bytes, pr->stats.resends,
+			pr->stats.retransmits);
+	}
+
+	if (pr->cb.done) {
+		pr->cb.done(pr, error, pr->cb.arg);
+	}
+
+	return(error ? PATCHRAM_FAILED : PATCHRAM_DONE);
+}
+
+/* Tell the host a step started, once its command is out */
+static void
+patchram_notify(patchram_t *pr)
+{
+	if (!pr->notified && pr->cb.step) {
+		pr->cb.step(pr, patchram_steps[pr->step].name, pr->cb.arg);
+	}
+
+	pr->notified = 1;
+}
+
+/* Start the current step again (repeat) or the next one that applies */
+static int
+patchram_begin(patchram_t *pr, int repeat)
+{
+	int i;
+
+	pr->tx_len = 0;
+	pr->sent = 0;
+	pr->rx_len = 0;
+	pr->rx_need = 0;
+	pr->resend_ms = 0;
+	pr->expire_ms = 0;
+	pr->deadline.tv_sec = 0;
+	pr->deadline.tv_nsec = 0;
+
+	while (patchram_steps[pr->step].name != NULL
+			&& !patchram_steps[pr->step].start(pr)) {
+		if (pr->error) {
+			return(patchram_finish(pr, pr->error));
+		}
+		pr->step++;
+		repeat = 0;
+	}
+
+	if (patchram_steps[pr->step].name == NULL) {
+		return(patchram_finish(pr, 0));
+	}
+
+	if (!repeat) {
+		patchram_now(&pr->t_step);
+		pr->notified = 0;
+	}
+
+	if (pr->resend_ms) {
+		patchram_arm(pr, pr->resend_ms * 1000L);
+	} else if (pr->expire_ms) {
+		patchram_arm(pr, pr->expire_ms * 1000L);
+	}
+
+	if (pr->tx_len == 0) {
+		patchram_notify(pr);
+		return(PATCHRAM_BUSY);
+	}
+
+	pr->stats.commands++;
+
+	if (pr->debug) {
+		log2file("writing\n");
+		for (i = 0; i < pr->tx_iovcnt; i++) {
+			patchram_dump(pr->tx_iov[i].iov_base, pr->tx_iov[i].iov_len);
+		}
+	}
+
+	if (pr->tp.ops->send(&pr->tp, pr->tx_iov, pr->tx_iovcnt) < 0) {
+		return(patchram_finish(pr, errno));
+	}
+
+	/*
+	 * Round trips count from here: io_uring may report the write done
+	 * only together with the answer.
+	 */
+	patchram_now(&pr->t_sent);
+
+	if (pr->cb.packet) {
+		pr->cb.packet(pr, 1, pr->tx_iov, pr->tx_iovcnt, pr->cb.arg);
+	}
+
+	return(PATCHRAM_BUSY);
+}
+
+/* Write what the transport holds, noting when the command is out */
+static int
+patchram_flush(patchram_t *pr)
+{
+	int ret;
+
+	if ((ret = pr->tp.ops->flush(&pr->tp)) <= 0) {
+		return(ret);
+	}
+
+	if (pr->tx_len && !pr->sent) {
+		pr->sent = 1;
+		pr->stats.tx_bytes += pr->tx_len;
+		patchram_notify(pr);
+	}
+
+	return(ret);
+}
+
+static int
+patchram_expired(const patchram_t *pr)
+{
+	struct timespec now;
+
+	if (pr->deadline.tv_sec == 0) {
+		return(0);
+	}
+
+	patchram_now(&now);
+
+	return(now.tv_sec > pr->deadline.tv_sec
+		|| (now.tv_sec == pr->deadline.tv_sec
+			&& now.tv_nsec >= pr->deadline.tv_nsec));
+}
+
+void
+patchram_init(patchram_t *pr)
+{
+	memset(pr, 0, sizeof(*pr));
+	pr->transport = &transport_h4;
+	pr->tp.ops = &transport_h4;
+	pr->tp.fd = -1;
+	pr->tp.poll_fd = -1;
+	rt_init(&pr->rt);
+	snprintf(pr->fw_index_cache, sizeof(pr->fw_index_cache), "%s",
+		FW_INDEX_CACHE);
+}
+
+patchram_t *
+patchram_create(arena_t *arena)
+{
+	patchram_t *pr;
+
+	if ((pr = arena_alloc(arena, sizeof(*pr))) == NULL) {
+		return(NULL);
+	}
+
+	patchram_init(pr);
+	pr->arena = arena;
+
+	return(pr);
+}
+
+int
+patchram_set_baudrate(patchram_t *pr, int baud_rate)
+{
+	if (!validate_baudrate(baud_rate, &pr->termios_baudrate)) {
+		return(-1);
+	}
+
+	pr->baudrate = baud_rate;
+
+	return(0);
+}
+
+int
+patchram_set_bdaddr(patchram_t *pr, const char *bd_addr)
+{
+	unsigned int b[6];
+	int i;
+
+	if (sscanf(bd_addr, "%02X:%02X:%02X:%02X:%02X:%02X",
+			&b[5], &b[4], &b[3], &b[2], &b[1], &b[0]) != 6) {
+		return(-1);
+	}
+
+	for (i = 0; i < 6; i++) {
+		pr->bdaddr[i] = b[i];
+	}
+
+	pr->bdaddr_set = 1;
+
+	return(0);
+}
+
+int
+patchram_start(patchram_t *pr, int fd)
+{
+	int flags;
+
+	pr->tp.ops = pr->transport;
+	pr->tp.fd = fd;
+	pr->tp.poll_fd = fd;
+	pr->tp.blocking = 0;
+	pr->tp.serial.low_latency = pr->low_latency;
+	transport_txq_reset(&pr->tp.txq);
+	pr->line_speed = B115200;
+	pr->download_speed = pr->use_baudrate_for_download
+		&& pr->termios_baudrate ? pr->termios_baudrate : B115200;
+	pr->recovering = 0;
+	pr->step = 0;
+	pr->rt.wait_us = -1;
+	pr->rt.preemptions = 0;
+	pr->error = 0;
+	pr->readable = 0;
+	memset(&pr->stats, 0, sizeof(pr->stats));
+	patchram_now(&pr->t_start);
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0
+			|| fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		pr->error = errno;
+		pr->state = PATCHRAM_FINISHED;
+		return(-1);
+	}
+
+	/* H5 frames its own packets, io_uring only carries H4 ones */
+	if (pr->io_uring && pr->transport->raw
+			&& transport_uring_setup(&pr->tp, pr->transport) < 0) {
+		log2file("io_uring not available (error %d), using poll\n",
+			errno);
+	}
+
+	if (pr->tp.ops->open(&pr->tp) < 0) {
+		pr->error = errno;
+		pr->state = PATCHRAM_FINISHED;
+		if (pr->tp.ops->close) {
+			pr->tp.ops->close(&pr->tp);
+		}
+		return(-1);
+	}
+
+	/* Resolve the firmware folder while the controller resets */
+	if (pr->image == NULL && !pr->prefetching) {
+		if (fw_prefetch_start(&pr->prefetch, pr->fw_folder,
+				pr->fw_index_cache, pr->arena) < 0) {
+			log2file("FW prefetch not started, error %d\n", errno);
+		}
+		pr->prefetching = 1;
+	}
+
+	rt_pin(&pr->rt);
+	pr->state = PATCHRAM_RUNNING;
+
+	return(patchram_begin(pr, 0) == PATCHRAM_FAILED ? -1 : 0);
+}
+
+int
+patchram_fd(const patchram_t *pr)
+{
+	return(pr->tp.poll_fd);
+}
+
+int
+patchram_events(const patchram_t *pr)
+{
+	if (pr->state != PATCHRAM_RUNNING) {
+		return(0);
+	}
+
+	/* Anything the controller sends is read, expected or not */
+	return(POLLIN | pr->tp.ops->events(&pr->tp));
+}
+
+int
+patchram_timeout(const patchram_t *pr)
+{
+	int ms, tp_ms;
+
+	if (pr->state != PATCHRAM_RUNNING) {
+		return(-1);
+	}
+
+	ms = pr->deadline.tv_sec ? transport_ms_left(&pr->deadline) : -1;
+	tp_ms = pr->tp.ops->timeout(&pr->tp);
+
+	if (ms < 0 || (tp_ms >= 0 && tp_ms < ms)) {
+		ms = tp_ms;
+	}
+
+	return(ms);
+}
+
+int
+patchram_handle(patchram_t *pr, int revents)
+{
+	const patchram_step_t *s;
+	struct timespec now;
+	struct iovec iov;
+	long us;
+	int ret;
+
+	if (pr->state == PATCHRAM_FINISHED) {
+		return(pr->error ? PATCHRAM_FAILED : PATCHRAM_DONE);
+	}
+
+	if (pr->state != PATCHRAM_RUNNING) {
+		return(PATCHRAM_BUSY);
+	}
+
+	if (revents & (POLLERR | POLLNVAL)) {
+		return(patchram_finish(pr, EIO));
+	}
+
+	pr->readable |= (revents & (POLLIN | POLLHUP)) != 0;
+
+	while (pr->state == PATCHRAM_RUNNING) {
+		s = &patchram_steps[pr->step];
+
+		/* The controller ignored HCI_Reset, say it again */
+		if (pr->resend_ms && patchram_expired(pr)) {
+			if (pr->tp.ops->send(&pr->tp, pr->tx_iov,
+					pr->tx_iovcnt) == 0) {
+				pr->sent = 0;
+				pr->stats.resends++;
+				patchram_now(&pr->t_sent);
+			}
+			patchram_arm(pr, pr->resend_ms * 1000L);
+		}
+
+		if (patchram_flush(pr) < 0) {
+			return(patchram_finish(pr, errno));
+		}
+
+		if (!pr->readable) {
+			ret = 0;
+		} else if ((ret = pr->tp.ops->recv(&pr->tp, pr->rx, &pr->rx_len,
+				pr->rx_need)) < 0) {
+			return(patchram_finish(pr, errno));
+		} else if (ret == 0) {
+			pr->readable = 0;
+
+			/* Link traffic read just now may have freed the output */
+			if (patchram_flush(pr) < 0) {
+				return(patchram_finish(pr, errno));
+			}
+		}
+
+		if (ret == 0) {
+			/* Only steps that wait for time end without input */
+			if (pr->expire_ms && patchram_expired(pr)) {
+				pr->rx_len = 0;
+			} else if (pr->tx_len || pr->rx_need
+					|| !patchram_expired(pr)) {
+				break;
+			}
+		} else {
+			if (pr->debug) {
+				log2file("received %d\n", pr->rx_len);
+				patchram_dump(pr->rx, pr->rx_len);
+			}
+
+			pr->stats.rx_bytes += pr->rx_len;
+
+			if (pr->cb.packet) {
+				iov.iov_base = pr->rx;
+				iov.iov_len = pr->rx_len;
+				pr->cb.packet(pr, 0, &iov, 1, pr->cb.arg);
+			}
+
+			/* io_uring can report the write and its answer at once */
+			if (!pr->sent && patchram_flush(pr) < 0) {
+				return(patchram_finish(pr, errno));
+			}
+
+			if (!pr->sent && !pr->rx_need) {
+				log2file("unexpected event 0x%02x dropped\n",
+					pr->rx[1]);
+				pr->rx_len = 0;
+				continue;
+			}
+
+			if (!pr->rx_need) {
+				pr->stats.events++;
+				patchram_now(&now);
+				us = patchram_us(&pr->t_sent, &now);
+				pr->stats.event_us += us;
+				if (us > pr->stats.max_event_us) {
+					pr->stats.max_event_us = us;
+				}
+			}
+		}
+
+		ret = s->done ? s->done(pr) : 0;
+
+		if (ret < 0) {
+			return(patchram_finish(pr, pr->error ? pr->error : EIO));
+		}
+
+		if (ret == 0) {
+			pr->step++;
+		} else if (ret == 2) {
+			pr->step = 0;
+			ret = 0;
+		}
+
+		if (patchram_begin(pr, ret) != PATCHRAM_BUSY) {
+			break;
+		}
+	}
+
+	if (pr->state == PATCHRAM_FINISHED) {
+		return(pr->error ? PATCHRAM_FAILED : PATCHRAM_DONE);
+	}
+
+	return(PATCHRAM_BUSY);
+}
+
+int
+patchram_run(patchram_t *pr, int fd)
+{
+	struct pollfd p;
+	int ret;
+
+	if (patchram_start(pr, fd) < 0) {
+		return(-1);
+	}
+
+	/* Transports that can wait better than poll() get to do it */
+	pr->tp.blocking = pr->tp.ops->wait != NULL;
+
+	p.fd = patchram_fd(pr);
+	p.revents = 0;
+
+	while ((ret = patchram_handle(pr, p.revents)) == PATCHRAM_BUSY) {
+		p.events = patchram_events(pr);
+		p.revents = 0;
+
+		if (pr->tp.blocking) {
+			if ((ret = pr->tp.ops->wait(&pr->tp,
+					patchram_timeout(pr))) > 0) {
+				p.revents = ret;
+			}
+		} else {
+			ret = poll(&p, 1, patchram_timeout(pr));
+		}
+
+		if (ret < 0 && errno != EINTR) {
+			patchram_finish(pr, errno);
+			return(-1);
+		}
+	}
+
+	return(ret == PATCHRAM_DONE ? 0 : -1);
+}
+
+static void
+plan_speed(transport_t *tp, int speed)
+{
+}
+
+/* Bytes a packet takes on the wire: H4 as it is, H5 as a SLIP frame */
+static int
+plan_wire_len(const patchram_t *pr, const struct iovec *iov, int n)
+{
+	const unsigned char *p;
+	int i, len = 0, bytes = 0;
+	size_t j;
+
+	for (i = 0; i < n; i++) {
+		len += iov[i].iov_len;
+	}
+
+	if (pr->transport != &transport_h5) {
+		return(len);
+	}
+
+	/* The type byte goes into the header, delimiters and escapes added */
+	bytes = 2 + 4 + len - 1;
+	for (i = 0; i < n; i++) {
+		p = iov[i].iov_base;
+		for (j = (i == 0); j < iov[i].iov_len; j++) {
+			bytes += (p[j] == 0xc0 || p[j] == 0xdb);
+		}
+	}
+
+	return(bytes);
+}
+
+/*
+ * Fill rx with the Command Complete a controller reporting chip_id sends
+ * for the step, returns its length.
+ */
+static int
+plan_event(patchram_t *pr, const patchram_step_t *s, const char *chip_id,
+	int opcode)
+{
+	int len = 7, subver;
+
+	memset(pr->rx, 0, sizeof(pr->rx));
+	pr->rx[0] = 0x04;
+	pr->rx[1] = 0x0e;
+	pr->rx[3] = 1;
+	pr->rx[4] = opcode & 0xff;
+	pr->rx[5] = opcode >> 8;
+
+	if (s->done == done_read_local_version) {
+		/* Chips the version table lacks go on to their name */
+		subver = fw_chip_subver(chip_id);
+		pr->rx[11] = FW_CHIP_BROADCOM;
+		pr->rx[13] = subver < 0 ? 0 : subver & 0xff;
+		pr->rx[14] = subver < 0 ? 0 : subver >> 8;
+		len = 7 + 8;
+	} else if (s->done == done_read_local_name) {
+		snprintf((char *)&pr->rx[1 + HCI_EVT_CMD_CMPL_LOCAL_NAME_STRING],
+			PATCHRAM_NAME_LEN, "%s", chip_id);
+		len = 1 + HCI_EVT_CMD_CMPL_LOCAL_NAME_STRING + 248;
+	}
+
+	pr->rx[2] = len - 3;
+
+	return(len);
+}
+
+long
+patchram_plan(patchram_t *pr, const char *chip_id,
+	const patchram_model_t *model)
+{
+	transport_ops_t ops = *pr->transport;
+	const patchram_step_t *s;
+	patchram_plan_cmd_t cmd;
+	struct iovec iov;
+	struct timespec now;
+	long total = 0;
+	int ret, rx_len, priority = pr->rt.priority;
+
+	/* Line rate changes are only noted, nothing runs real-time */
+	pr->rt.priority = 0;
+	ops.speed = plan_speed;
+	pr->tp.ops = &ops;
+	pr->line_speed = B115200;
+	pr->download_speed = pr->use_baudrate_for_download
+		&& pr->termios_baudrate ? pr->termios_baudrate : B115200;
+	pr->recovering = 0;
+	pr->error = 0;
+	memset(&pr->stats, 0, sizeof(pr->stats));
+	patchram_now(&pr->t_start);
+
+	if (pr->image == NULL && !pr->prefetching) {
+		if (fw_prefetch_start(&pr->prefetch, pr->fw_folder,
+				pr->fw_index_cache, pr->arena) < 0) {
+			log2file("FW prefetch not started, error %d\n", errno);
+		}
+		pr->prefetching = 1;
+	}
+
+	for (pr->step = 0; patchram_steps[pr->step].name != NULL; ) {
+		s = &patchram_steps[pr->step];
+		pr->tx_len = 0;
+		pr->rx_need = 0;
+		pr->deadline.tv_sec = 0;
+		pr->deadline.tv_nsec = 0;
+
+		if (!s->start(pr)) {
+			if (pr->error) {
+				pr->tp.ops = pr->transport;
+				pr->rt.priority = priority;
+				return(-1);
+			}
+			pr->step++;
+			continue;
+		}
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.step = s->name;
+		cmd.baudrate = patchram_rate(pr->line_speed);
+
+		if (pr->tx_len) {
+			cmd.opcode = patchram_opcode(pr);
+			cmd.tx_bytes = plan_wire_len(pr, pr->tx_iov,
+				pr->tx_iovcnt);
+
+			pr->rx_len = plan_event(pr, s, chip_id, cmd.opcode);
+			rx_len = pr->rx_len;
+			iov.iov_base = pr->rx;
+			iov.iov_len = rx_len;
+			cmd.rx_bytes = plan_wire_len(pr, &iov, 1);
+
+			if (s->start == start_reset) {
+				cmd.wait_us = model->reset_us;
+			} else if (s->start == start_launch_ram) {
+				cmd.wait_us = model->launch_us;
+			} else {
+				cmd.wait_us = model->cmd_us;
+			}
+
+			/* H5 acknowledges the event with a frame of its own */
+			if (pr->transport == &transport_h5) {
+				cmd.tx_bytes += 2 + 4;
+			}
+
+			pr->stats.commands++;
+			pr->stats.events++;
+		} else if (pr->rx_need) {
+			pr->rx_len = pr->rx_need;
+			cmd.rx_bytes = pr->rx_need;
+		} else if (pr->deadline.tv_sec) {
+			patchram_now(&now);
+			cmd.wait_us = patchram_us(&now, &pr->deadline);
+		}
+
+		cmd.wire_us = (cmd.tx_bytes + cmd.rx_bytes) * 10 * 1000000LL
+			/ cmd.baudrate;
+		total += cmd.wire_us + cmd.wait_us;
+		pr->stats.tx_bytes += cmd.tx_bytes;
+		pr->stats.rx_bytes += cmd.rx_bytes;
+
+		if (pr->cb.plan) {
+			pr->cb.plan(pr, &cmd, pr->cb.arg);
+		}
+
+		if ((ret = s->done ? s->done(pr) : 0) < 0) {
+			pr->tp.ops = pr->transport;
+			pr->rt.priority = priority;
+			return(-1);
+		}
+
+		if (ret == 0) {
+			pr->step++;
+		}
+	}
+
+	pr->tp.ops = pr->transport;
+	pr->rt.priority = priority;
+	pr->stats.total_us = total;
+
+	return(total);
+}
+
+int
+patchram_enable_hci(patchram_t *pr)
+{
+	int i = N_HCI;
+	int proto = pr->transport->hci_proto;
+	if (proto < 0) {
+		log2file("%s transport can't be attached\n", pr->transport->name);
+		return(-1);
+	}
+
+	if (ioctl(pr->tp.fd, TIOCSETD, &i) < 0) {
+		log2file("Can't set line discipline\n");
+		return(-1);
+	}
+
+	if (ioctl(pr->tp.fd, HCIUARTSETPROTO, proto) < 0) {
+		log2file("Can't set hci protocol\n");
+		return(-1);
+	}
+	log2file("Done setting line discpline\n");
+	return(0);
+}
+
+void
+patchram_free(patchram_t *pr)
+{
+	if (pr->image == &pr->builtin) {
+		hcd_unmap(&pr->builtin);
+	} else if (pr->image == &pr->stored) {
+		hcd_unmap(&pr->stored);
+	}
+
+	if (pr->state == PATCHRAM_RUNNING) {
+		rt_leave(&pr->rt);
+		rt_unpin(&pr->rt);
+		if (pr->tp.ops->close) {
+			pr->tp.ops->close(&pr->tp);
+		}
+	}
+
+	if (pr->prefetching) {
+		fw_prefetch_free(&pr->prefetch);
+		pr->prefetching = 0;
+	}
+
+	pr->image = NULL;
+	pr->state = PATCHRAM_IDLE;
+}
@@ -0,0 +1,275 @@
+/*****************************************************************************
+**
+**  Name:          patchram.h
+**
+**  Description:   libbrcmpatchram, the patchram bring-up as a library.
+**
+**                 A patchram_t holds everything one bring-up needs: the
+**                 settings, the UART, the firmware image and the progress
+**                 of the HCI exchange, so a host can drive any number of
+**                 controllers without globals.  The exchange never blocks
+**                 on the UART; the host runs it from its own event loop:
+**
+**                     patchram_start(pr, fd);
+**                     while (patchram_handle(pr, revents) == PATCHRAM_BUSY)
+**                         poll patchram_fd(pr) for patchram_events(pr),
+**                         waiting at most patchram_timeout(pr) ms
+**
+**                 patchram_run() is that loop for callers that may block.
+**                 Messages are written with log2file(), which the host
+**                 provides.
+**
+**                 With pr->fw_store set, images are taken from that
+**                 content-addressed store before the folder; see fw_store.h.
+**
+**                 With pr->rt.priority set the download runs under
+**                 SCHED_FIFO, on pr->rt.cpu if that is set too; see rt.h.
+**
+**                 A context made by patchram_create() lives in a fixed
+**                 arena together with the folder index and prefetch tables
+**                 it builds; with a NULL arena (or patchram_init() on the
+**                 caller's own storage) those come from the heap.
+**
+******************************************************************************/
+
+#ifndef __PATCHRAM__H__
+#define __PATCHRAM__H__
+
+#include <time.h>
+
+#include "hcd.h"
+#include "arena.h"
+#include "fw_alias.h"
+#include "fw_chip.h"
+#include "fw_prefetch.h"
+#include "transport.h"
+#include "rt.h"
+
+#ifndef N_HCI
+#define N_HCI	15
+#endif
+
+#define HCIUARTSETPROTO		_IOW('U', 200, int)
+#define HCIUARTGETPROTO		_IOR('U', 201, int)
+#define HCIUARTGETDEVICE	_IOR('U', 202, int)
+
+/* Values returned by patchram_handle() */
+#define PATCHRAM_FAILED		-1
+#define PATCHRAM_BUSY		0
+#define PATCHRAM_DONE		1
+
+#define PATCHRAM_NAME_LEN	32
+#define PATCHRAM_PKT_LEN	TRANSPORT_PKT_LEN
+
+/* Downloads started at most, each one a rate lower than the last */
+#define PATCHRAM_DOWNLOAD_TRIES	4
+
+/* Why a download command failed */
+#define PATCHRAM_FAIL_TIMEOUT	1	/* no answer in time */
+#define PATCHRAM_FAIL_EVENT	2	/* not the Command Complete of it */
+#define PATCHRAM_FAIL_STATUS	3	/* completed with an error status */
+
+typedef struct patchram patchram_t;
+
+typedef struct {
+	int reason;			/* PATCHRAM_FAIL_* */
+	int record;			/* index in the image, -1: minidriver */
+	unsigned long offset;		/* of the record in the image */
+	int opcode;
+	int status;			/* of the Command Complete, if any */
+	int baudrate;			/* the download ran at */
+} patchram_failure_t;
+
+
+typedef struct {
+	unsigned int commands;		/* HCI commands written */
+	unsigned int events;		/* HCI events read back */
+	unsigned int records;		/* patchram records downloaded */
+	unsigned int resends;		/* HCI_Reset retransmissions */
+	unsigned int retransmits;	/* transport (H5) retransmissions */
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;
+	unsigned int writes;		/* write system calls (or io_uring writes) */
+	unsigned int short_writes;	/* that wrote part of what was queued */
+	long reset_us;			/* first HCI_Reset to its completion */
+	long download_us;		/* minidriver to the reset launching it */
+	long total_us;			/* patchram_start() to the end */
+	long max_event_us;		/* slowest command to event round trip */
+	long event_us;			/* all round trips, for the mean */
+	unsigned int download_failures;	/* downloads started over */
+	patchram_failure_t failures[PATCHRAM_DOWNLOAD_TRIES];
+} patchram_stats_t;
+
+/* How long the controller takes to answer, for patchram_plan() */
+typedef struct {
+	long cmd_us;			/* a command, write to event */
+	long reset_us;			/* the first HCI_Reset */
+	long launch_us;			/* the reset booting the patchram */
+} patchram_model_t;
+
+/* Defaults of the model, a -d bring-up log tells the real values */
+#define PATCHRAM_MODEL_CMD_US		200
+#define PATCHRAM_MODEL_RESET_US		5000
+#define PATCHRAM_MODEL_LAUNCH_US	100000
+
+/* One exchange of a planned bring-up */
+typedef struct {
+	const char *step;
+	int opcode;			/* of the command, 0 for none */
+	int tx_bytes;			/* on the wire, framing included */
+	int rx_bytes;
+	int baudrate;			/* line rate it runs at */
+	long wire_us;			/* to move tx_bytes and rx_bytes */
+	long wait_us;			/* controller latency or a delay */
+} patchram_plan_cmd_t;
+
+typedef struct {
+	/* A step of the sequence started, its command (if any) is written */
+	void (*step)(patchram_t *pr, const char *step, void *arg);
+	/* The sequence ended, error is 0 or an errno value */
+	void (*done)(patchram_t *pr, int error, void *arg);
+	/* patchram_plan() scheduled an exchange */
+	void (*plan)(patchram_t *pr, const patchram_plan_cmd_t *cmd,
+		void *arg);
+	/*
+	 * An H4 packet went out (out 1: a command, in n pieces) or came in
+	 * (out 0: an event, or the raw bytes a step waited for)
+	 */
+	void (*packet)(patchram_t *pr, int out, const struct iovec *iov,
+		int n, void *arg);
+	void *arg;
+} patchram_callbacks_t;
+
+struct patchram {
+	/* Settings, patchram_init() sets the defaults */
+	int debug;
+	int baudrate;			/* operational rate, 0 stays at 115200 */
+	int use_baudrate_for_download;
+	int bdaddr_set;
+	unsigned char bdaddr[6];	/* little endian, as on the wire */
+	int enable_lpm;
+	int scopcm;
+	unsigned char sco_pcm_int[5];
+	unsigned char pcm_data_format[5];
+	int i2s;
+	unsigned char i2spcm_param[4];
+	int no2bytes;
+	int tosleep;			/* us to wait before the download */
+	char fw_folder[HCD_PATH_LEN];
+	char fw_index_cache[HCD_PATH_LEN];
+	char fw_store[HCD_PATH_LEN];	/* firmware store, "": none */
+	const fw_alias_set_t *aliases;	/* NULL for the built-in rules */
+	arena_t *arena;			/* for tables, NULL: the heap */
+	const transport_ops_t *transport;	/* transport_h4 by default */
+	int io_uring;			/* carry H4 over io_uring if possible */
+	int low_latency;		/* UART tuned for event latency */
+	rt_t rt;			/* CPU and SCHED_FIFO priority, results */
+	patchram_callbacks_t cb;
+
+	/* Results */
+	char chip_id[PATCHRAM_NAME_LEN];
+	fw_chip_version_t version;	/* what the controller reported */
+	hcd_image_t *image;		/* kept for warm bring-ups */
+	patchram_stats_t stats;
+	int error;
+
+	/* Progress of the exchange */
+	transport_t tp;
+	int termios_baudrate;
+	int download_speed;		/* B* value the download runs at */
+	int line_speed;			/* B* value the UART is set to */
+	int recovering;			/* a download failed, reset first */
+	int step;
+	int state;
+	int notified;			/* the step callback saw this step */
+	int readable;
+	unsigned char tx[PATCHRAM_PKT_LEN];
+	struct iovec tx_iov[2];		/* tx, or its type byte and a record */
+	int tx_iovcnt;
+	int tx_len;
+	int sent;			/* the transport wrote all of tx */
+	unsigned char rx[PATCHRAM_PKT_LEN];
+	int rx_len;
+	int rx_need;			/* 0 for an event, else raw bytes */
+	int resend_ms;			/* resend period while unanswered */
+	int expire_ms;			/* or time to give up on an answer */
+	struct timespec deadline;
+	struct timespec t_start;
+	struct timespec t_step;
+	struct timespec t_sent;
+	struct timespec t_download;
+	size_t fw_off;
+	size_t fw_rec_off;		/* of the record being downloaded */
+	int fw_record;
+	hcd_image_t builtin;
+	hcd_image_t stored;		/* mapped from pr->fw_store */
+	fw_prefetch_t prefetch;
+	int prefetching;
+};
+
+extern void patchram_init(patchram_t *pr);
+
+/* A context allocated and initialized in arena, NULL when it is full */
+extern patchram_t *patchram_create(arena_t *arena);
+
+/* Set the operational baud rate, returns -1 if it is not supported */
+extern int patchram_set_baudrate(patchram_t *pr, int baud_rate);
+
+/* Set the BD address from "XX:XX:XX:XX:XX:XX", returns -1 if malformed */
+extern int patchram_set_bdaddr(patchram_t *pr, const char *bd_addr);
+
+/*
+ * Start a bring-up on fd, which is switched to non-blocking mode.  The
+ * first one reads the chip ID and resolves its firmware; once an image is
+ * known, later ones on the same context (a re-patch) reuse it.
+ *
+ * A download command that times out or is not completed successfully
+ * makes the bring-up reset the controller and download again at the next
+ * lower rate, up to PATCHRAM_DOWNLOAD_TRIES times; stats.failures tells
+ * which records failed and at what rate.
+ */
+extern int patchram_start(patchram_t *pr, int fd);
+
+/* The descriptor to poll: fd itself, or the io_uring carrying it */
+extern int patchram_fd(const patchram_t *pr);
+
+/* poll() events the exchange waits for, 0 when it only waits for time */
+extern int patchram_events(const patchram_t *pr);
+
+/* Milliseconds until the exchange needs patchram_handle(), -1 for never */
+extern int patchram_timeout(const patchram_t *pr);
+
+/*
+ * Advance the exchange with the poll() revents seen on patchram_fd() (0
+ * after a timeout).  Returns PATCHRAM_BUSY, PATCHRAM_DONE or
+ * PATCHRAM_FAILED, in which case pr->error tells why (ENOENT: no firmware
+ * for the chip).
+ */
+extern int patchram_handle(patchram_t *pr, int revents);
+
+/* Whole bring-up on fd, blocking; returns 0 or -1 with pr->error set */
+extern int patchram_run(patchram_t *pr, int fd);
+
+/*
+ * Plan the bring-up of a controller reporting chip_id without touching
+ * any device: the firmware is resolved and the step sequence run as
+ * patchram_run() would, with every exchange passed to cb.plan and timed
+ * for the line rates of the settings (8N1) and the latency model.
+ * Returns the projected total in us, or -1 with pr->error set.
+ */
+extern long patchram_plan(patchram_t *pr, const char *chip_id,
+	const patchram_model_t *model);
+
+/* Attach the patched controller to the kernel HCI UART driver */
+extern int patchram_enable_hci(patchram_t *pr);
+
+extern void patchram_free(patchram_t *pr);
+
+/* Hex dump of a packet to the log, as the debug log shows them */
+extern void patchram_dump(const unsigned char *out, int len);
+
+extern int validate_baudrate(int baud_rate, int *value);
+extern void BRCM_encode_baud_rate(unsigned int baud_rate,
+	unsigned char *encoded_baud);
+
+#endif
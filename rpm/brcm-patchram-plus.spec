@@ -18,6 +18,8 @@ Source100:  brcm-patchram-plus.yaml
 Requires:   glibc
 BuildRequires:  gcc
 BuildRequires:  glibc
+BuildRequires:  glibc-static
+BuildRequires:  make
 
 %description
 This program downloads a patchram files in the HCD format to Broadcom Bluetooth based silicon and combo chips and and other utility functions.
@@ -31,7 +33,7 @@ This program downloads a patchram files in the HCD format to Broadcom Bluetooth
 
 %build
 # >> build pre
-gcc -o brcm_patchram_plus brcm_patchram_plus.c
+make GXX=gcc
 # << build pre
 
 
@@ -0,0 +1,192 @@
+/*****************************************************************************
+**
+**  Name:          rt.c
+**
+**  Description:   Real-time scheduling of the download.
+**
+******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "rt.h"
+
+extern void log2file(const char *fmt, ...);
+
+void
+rt_init(rt_t *rt)
+{
+	memset(rt, 0, sizeof(*rt));
+	rt->cpu = -1;
+	rt->wait_us = -1;
+}
+
+/* ns the thread has waited on a runqueue so far, -1 if not accounted */
+static long long
+rt_run_delay(void)
+{
+	long long run, delay;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/thread-self/schedstat", "r")) == NULL) {
+		return(-1);
+	}
+
+	if (fscanf(fp, "%lld %lld", &run, &delay) != 2) {
+		delay = -1;
+	}
+
+	fclose(fp);
+
+	return(delay);
+}
+
+static long
+rt_nivcsw(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru) < 0) {
+		return(0);
+	}
+
+	return(ru.ru_nivcsw);
+}
+
+/*
+ * Lock the stack the download runs on, just the part below the caller
+ * rather than every future mapping as mlockall() would
+ */
+static void
+rt_lock_stack(rt_t *rt)
+{
+	volatile unsigned char stack[RT_STACK_LOCK];
+
+	stack[0] = 0;
+	if (mlock((const void *)stack, sizeof(stack)) < 0) {
+		log2file("can't lock the stack, error %d\n", errno);
+		return;
+	}
+
+	rt->lock_p[rt->nlocks] = (const void *)stack;
+	rt->lock_len[rt->nlocks++] = sizeof(stack);
+}
+
+void
+rt_pin(rt_t *rt)
+{
+	cpu_set_t set;
+
+	if (rt->cpu < 0 || rt->pinned) {
+		return;
+	}
+
+	if (sched_getaffinity(0, sizeof(rt->cpus), (cpu_set_t *)rt->cpus) < 0) {
+		log2file("CPU affinity unknown, error %d\n", errno);
+		return;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(rt->cpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		log2file("can't pin to CPU %d, error %d\n", rt->cpu, errno);
+		return;
+	}
+
+	rt->pinned = 1;
+}
+
+void
+rt_unpin(rt_t *rt)
+{
+	if (!rt->pinned) {
+		return;
+	}
+
+	sched_setaffinity(0, sizeof(rt->cpus), (cpu_set_t *)rt->cpus);
+	rt->pinned = 0;
+}
+
+void
+rt_enter(rt_t *rt, const void **p, const size_t *len, int n)
+{
+	struct sched_param param;
+	int i;
+
+	if (rt->entered) {
+		return;
+	}
+
+	rt->entered = 1;
+	rt->fifo = 0;
+	rt->nlocks = 0;
+
+	if (rt->priority > 0) {
+		/* mlock() faults the pages in as it locks them */
+		for (i = 0; i < n && rt->nlocks < RT_MAX_LOCKS - 1; i++) {
+			if (len[i] == 0) {
+				continue;
+			}
+			if (mlock(p[i], len[i]) < 0) {
+				log2file("can't lock %lu bytes, error %d\n",
+					(unsigned long)len[i], errno);
+				continue;
+			}
+			rt->lock_p[rt->nlocks] = p[i];
+			rt->lock_len[rt->nlocks++] = len[i];
+		}
+
+		rt_lock_stack(rt);
+
+		rt->policy = sched_getscheduler(0);
+		sched_getparam(0, &rt->param);
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rt->priority;
+
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+			log2file("can't run SCHED_FIFO at %d, error %d\n",
+				rt->priority, errno);
+		} else {
+			rt->fifo = 1;
+		}
+	}
+
+	/* Taken last, so the setup above is not counted */
+	rt->run_delay_ns = rt_run_delay();
+	rt->nivcsw = rt_nivcsw();
+}
+
+void
+rt_leave(rt_t *rt)
+{
+	long long delay;
+	int i;
+
+	if (!rt->entered) {
+		return;
+	}
+
+	delay = rt_run_delay();
+	rt->wait_us = delay < 0 || rt->run_delay_ns < 0 ? -1
+		: (delay - rt->run_delay_ns) / 1000;
+	rt->preemptions = rt_nivcsw() - rt->nivcsw;
+
+	if (rt->fifo) {
+		sched_setscheduler(0, rt->policy, &rt->param);
+	}
+
+	for (i = 0; i < rt->nlocks; i++) {
+		munlock(rt->lock_p[i], rt->lock_len[i]);
+	}
+
+	rt->nlocks = 0;
+	rt->entered = 0;
+}
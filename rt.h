@@ -0,0 +1,69 @@
+/*****************************************************************************
+**
+**  Name:          rt.h
+**
+**  Description:   Real-time scheduling of the download.
+**
+**                 On a loaded system the bring-up thread can lose its CPU
+**                 between an event and the next record, and every such
+**                 gap adds up over hundreds of records.  When asked to,
+**                 the thread is pinned to one CPU for the bring-up and
+**                 runs under SCHED_FIFO for the download only, with the
+**                 image, buffers and stack locked, so
+**                 it neither waits for a runqueue nor for a page fault.
+**
+**                 Whether asked or not, the time the thread spent runnable
+**                 but not running during the download (schedstat) and how
+**                 often it was preempted are measured.
+**
+******************************************************************************/
+
+#ifndef __RT__H__
+#define __RT__H__
+
+#include <stddef.h>
+#include <sched.h>
+
+#define RT_MAX_LOCKS		3	/* regions locked, the stack included */
+#define RT_STACK_LOCK		(16 * 1024)
+
+typedef struct {
+	/* Settings */
+	int cpu;			/* pin to, -1: don't */
+	int priority;			/* SCHED_FIFO priority, 0: don't */
+
+	/* Results of the last download */
+	long wait_us;			/* runnable, not running, -1: unknown */
+	unsigned int preemptions;	/* involuntary context switches */
+	int fifo;			/* it did run under SCHED_FIFO */
+
+	/* State */
+	int pinned;
+	unsigned long cpus[1024 / (8 * sizeof(unsigned long))];
+	int entered;
+	int policy;
+	struct sched_param param;
+	const void *lock_p[RT_MAX_LOCKS];
+	size_t lock_len[RT_MAX_LOCKS];
+	int nlocks;
+	long long run_delay_ns;
+	long nivcsw;
+} rt_t;
+
+/* Defaults: nothing pinned, no SCHED_FIFO */
+extern void rt_init(rt_t *rt);
+
+/* Pin the calling thread to rt->cpu, and back where it could run */
+extern void rt_pin(rt_t *rt);
+extern void rt_unpin(rt_t *rt);
+
+/*
+ * Start the download: lock the n regions and the stack below, and switch
+ * to SCHED_FIFO at rt->priority.  Failures are logged, not fatal.
+ */
+extern void rt_enter(rt_t *rt, const void **p, const size_t *len, int n);
+
+/* End it: the old policy back, regions unlocked, results filled in */
+extern void rt_leave(rt_t *rt);
+
+#endif
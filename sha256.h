@@ -0,0 +1,32 @@
+/*****************************************************************************
+**
+**  Name:          sha256.h
+**
+**  Description:   SHA-256 (FIPS 180-4), for naming firmware by content.
+**
+******************************************************************************/
+
+#ifndef __SHA256__H__
+#define __SHA256__H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN		32
+#define SHA256_HEX_LEN		(2 * SHA256_LEN + 1)
+
+typedef struct {
+	uint32_t h[8];
+	uint64_t bytes;
+	unsigned char buf[64];
+	int buf_len;
+} sha256_t;
+
+extern void sha256_init(sha256_t *c);
+extern void sha256_update(sha256_t *c, const void *data, size_t len);
+extern void sha256_final(sha256_t *c, unsigned char digest[SHA256_LEN]);
+
+/* The digest as lower case hex, hex holds SHA256_HEX_LEN bytes */
+extern void sha256_hex(const unsigned char digest[SHA256_LEN], char *hex);
+
+#endif
@@ -0,0 +1,403 @@
+/*****************************************************************************
+**
+**  Name:          transport.c
+**
+**  Description:   H4 and socket transports, the transmit queue and the
+**                 helpers the UART transports share.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#include "transport.h"
+
+extern void log2file(const char *fmt, ...);
+
+static const transport_ops_t *transports[] = {
+	&transport_h4,
+	&transport_h5,
+	&transport_socket,
+	NULL
+};
+
+const transport_ops_t *
+transport_find(const char *name)
+{
+	int i;
+
+	for (i = 0; transports[i]; i++) {
+		if (strcasecmp(transports[i]->name, name) == 0) {
+			return(transports[i]);
+		}
+	}
+
+	return(NULL);
+}
+
+int
+transport_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		return(-1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, strlen(path));
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return(-1);
+	}
+
+	return(fd);
+}
+
+void
+transport_txq_reset(transport_txq_t *q)
+{
+	memset(q, 0, sizeof(*q));
+}
+
+int
+transport_txq_add(transport_txq_t *q, const struct iovec *iov, int n)
+{
+	int i;
+
+	if (q->count + n > TRANSPORT_TXQ_LEN && q->head > 0) {
+		memmove(q->iov, q->iov + q->head,
+			(q->count - q->head) * sizeof(q->iov[0]));
+		q->count -= q->head;
+		q->head = 0;
+	}
+
+	if (q->count + n > TRANSPORT_TXQ_LEN) {
+		errno = EAGAIN;
+		return(-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (iov[i].iov_len > 0) {
+			q->iov[q->count++] = iov[i];
+			q->queued += iov[i].iov_len;
+		}
+	}
+
+	return(0);
+}
+
+int
+transport_txq_flush(transport_txq_t *q, int fd)
+{
+	struct iovec *v;
+	ssize_t n;
+
+	while (q->head < q->count) {
+		n = writev(fd, q->iov + q->head, q->count - q->head);
+
+		if (n < 0) {
+			return(errno == EAGAIN || errno == EINTR ? 0 : -1);
+		}
+
+		q->writes++;
+		q->drained += n;
+
+		/* Drop what went out, a piece written in part stays at head */
+		while (q->head < q->count
+				&& (size_t)n >= q->iov[q->head].iov_len) {
+			n -= q->iov[q->head].iov_len;
+			q->head++;
+		}
+
+		if (n > 0) {
+			v = &q->iov[q->head];
+			v->iov_base = (unsigned char *)v->iov_base + n;
+			v->iov_len -= n;
+		}
+
+		if (q->head < q->count) {
+			q->short_writes++;
+		}
+	}
+
+	q->head = 0;
+	q->count = 0;
+
+	return(1);
+}
+
+int
+transport_txq_empty(const transport_txq_t *q)
+{
+	return(q->head == q->count);
+}
+
+void
+transport_arm(struct timespec *ts, long ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Milliseconds left until ts, rounded up; 0 once it passed */
+long
+transport_ms_left(const struct timespec *ts)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (ts->tv_sec - now.tv_sec) * 1000
+		+ (ts->tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+	return(ms < 0 ? 0 : ms);
+}
+
+/* Lowest RX FIFO trigger through sysfs, the 8250 driver has it */
+static int
+transport_rx_trig(int fd)
+{
+	char path[64], buf[16];
+	struct stat st;
+	int f, n, level = -1;
+
+	if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode)) {
+		return(-1);
+	}
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/rx_trig_bytes",
+		major(st.st_rdev), minor(st.st_rdev));
+
+	if ((f = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+		return(-1);
+	}
+
+	/* The driver rounds down to a level the UART has */
+	if (write(f, "1", 1) == 1 && lseek(f, 0, SEEK_SET) == 0
+			&& (n = read(f, buf, sizeof(buf) - 1)) > 0) {
+		buf[n] = 0;
+		level = atoi(buf);
+	}
+
+	close(f);
+
+	return(level);
+}
+
+static void
+transport_tty_tune(transport_t *tp)
+{
+	transport_serial_t *s = &tp->serial;
+#ifdef TIOCGSERIAL
+	struct serial_struct ss;
+#endif
+
+	s->type = -1;
+	s->xmit_fifo_size = 0;
+	s->baud_base = 0;
+	s->async_low_latency = 0;
+	s->rx_trig_bytes = -1;
+
+	if (!s->low_latency) {
+		return;
+	}
+
+#ifdef TIOCGSERIAL
+	/* ptys and many USB adapters have no serial_struct at all */
+	if (ioctl(tp->fd, TIOCGSERIAL, &ss) == 0) {
+		s->type = ss.type;
+		s->xmit_fifo_size = ss.xmit_fifo_size;
+		s->baud_base = ss.baud_base;
+
+		if (!(ss.flags & ASYNC_LOW_LATENCY)) {
+			ss.flags |= ASYNC_LOW_LATENCY;
+			if (ioctl(tp->fd, TIOCSSERIAL, &ss) < 0) {
+				ss.flags &= ~ASYNC_LOW_LATENCY;
+			}
+		}
+
+		s->async_low_latency = (ss.flags & ASYNC_LOW_LATENCY) != 0;
+	}
+#endif
+
+	s->rx_trig_bytes = transport_rx_trig(tp->fd);
+
+	if (s->type < 0) {
+		log2file("serial: no driver information, low_latency not set\n");
+	} else {
+		log2file("serial: type %d, %d byte FIFO, base %d, "
+			"low_latency %s, RX trigger %d\n", s->type,
+			s->xmit_fifo_size, s->baud_base,
+			s->async_low_latency ? "on" : "not supported",
+			s->rx_trig_bytes);
+	}
+}
+
+int
+transport_tty_open(transport_t *tp, int flow)
+{
+	tcgetattr(tp->fd, &tp->termios);
+
+#ifndef __CYGWIN__
+	cfmakeraw(&tp->termios);
+#else
+	tp->termios.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
+                | INLCR | IGNCR | ICRNL | IXON);
+	tp->termios.c_oflag &= ~OPOST;
+	tp->termios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	tp->termios.c_cflag &= ~(CSIZE | PARENB);
+	tp->termios.c_cflag |= CS8;
+#endif
+
+	if (flow) {
+		tp->termios.c_cflag |= CRTSCTS;
+	} else {
+		tp->termios.c_cflag &= ~CRTSCTS;
+	}
+
+	/* A blocking read returns as soon as any of an event is there */
+	tp->termios.c_cc[VMIN] = 1;
+	tp->termios.c_cc[VTIME] = 0;
+
+	cfsetospeed(&tp->termios, B115200);
+	cfsetispeed(&tp->termios, B115200);
+
+	/* One change, then drop what came in under the old settings */
+	tcsetattr(tp->fd, TCSANOW, &tp->termios);
+	tcflush(tp->fd, TCIOFLUSH);
+
+	transport_tty_tune(tp);
+
+	return(0);
+}
+
+void
+transport_tty_speed(transport_t *tp, int speed)
+{
+	cfsetospeed(&tp->termios, speed);
+	cfsetispeed(&tp->termios, speed);
+	tcsetattr(tp->fd, TCSANOW, &tp->termios);
+}
+
+static int
+h4_open(transport_t *tp)
+{
+	return(transport_tty_open(tp, 1));
+}
+
+static int
+h4_send(transport_t *tp, const struct iovec *iov, int n)
+{
+	return(transport_txq_add(&tp->txq, iov, n));
+}
+
+static int
+h4_flush(transport_t *tp)
+{
+	return(transport_txq_flush(&tp->txq, tp->fd));
+}
+
+/* Read up to the end of the awaited event or raw bytes, nothing more */
+static int
+h4_recv(transport_t *tp, unsigned char *pkt, int *len, int need)
+{
+	ssize_t n;
+	int want;
+
+	while (1) {
+		if (need) {
+			want = need;
+		} else if (*len < 3) {
+			want = 3;
+		} else {
+			want = 3 + pkt[2];
+		}
+
+		if (*len == want) {
+			return(1);
+		}
+
+		n = read(tp->fd, pkt + *len, want - *len);
+
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return(0);
+		}
+
+		if (n <= 0) {
+			if (n == 0) {
+				errno = EPIPE;
+			}
+			return(-1);
+		}
+
+		*len += n;
+	}
+}
+
+static int
+h4_events(const transport_t *tp)
+{
+	return(transport_txq_empty(&tp->txq) ? 0 : POLLOUT);
+}
+
+static int
+h4_timeout(const transport_t *tp)
+{
+	return(-1);
+}
+
+const transport_ops_t transport_h4 = {
+	"h4", HCI_UART_H4, 1,
+	h4_open, transport_tty_speed,
+	h4_send, h4_flush, h4_recv, h4_events, h4_timeout
+};
+
+static int
+socket_open(transport_t *tp)
+{
+	return(0);
+}
+
+/* An emulator has no line speed */
+static void
+socket_speed(transport_t *tp, int speed)
+{
+}
+
+const transport_ops_t transport_socket = {
+	"socket", -1, 1,
+	socket_open, socket_speed,
+	h4_send, h4_flush, h4_recv, h4_events, h4_timeout
+};
@@ -0,0 +1,227 @@
+/*****************************************************************************
+**
+**  Name:          transport.h
+**
+**  Description:   HCI transports under the patchram exchange.
+**
+**                 The exchange hands a transport whole H4 style packets
+**                 (packet type byte first) and gets whole events back; how
+**                 they travel is up to the backend:
+**
+**                 transport_h4      H4 framing on a UART
+**                 transport_h5      Three-wire UART (H5): SLIP framing,
+**                                   link establishment and a sliding
+**                                   window of acknowledged, retransmitted
+**                                   packets
+**                 transport_socket  H4 framing on a Unix socket or a pty,
+**                                   without any tty setup, for testing
+**                                   against a controller emulator
+**                 transport_uring   The H4 framing of transport_h4 or
+**                                   transport_socket carried by io_uring:
+**                                   a command write and the read of its
+**                                   event go in as one linked submission
+**                                   on registered buffers, and the ring
+**                                   is polled instead of the UART
+**
+**                 All of them are non-blocking and keep their state in
+**                 the transport_t.  The UART ones write through a
+**                 transport_txq_t: packets are queued as iovecs, without
+**                 copying, and drained with as few writev() calls as the
+**                 tty takes, resuming inside a packet after a short write.
+**
+******************************************************************************/
+
+#ifndef __TRANSPORT__H__
+#define __TRANSPORT__H__
+
+#include <time.h>
+#include <sys/uio.h>
+#ifdef ANDROID
+#include <termios.h>
+#else
+#include <sys/termios.h>
+#endif
+
+#include "hcd.h"
+
+#define HCI_UART_H4		0
+#define HCI_UART_BCSP	1
+#define HCI_UART_3WIRE	2
+#define HCI_UART_H4DS	3
+#define HCI_UART_LL		4
+
+/* Largest H4 packet: type, opcode or event header and 255 bytes */
+#define TRANSPORT_PKT_LEN	(1 + HCD_RECORD_HDR_LEN + 255)
+
+#define H5_TX_WIN		4	/* sliding window offered to the peer */
+#define H5_OUT_LEN		2048
+#define H5_IN_LEN		(4 + TRANSPORT_PKT_LEN + 2)
+
+#define TRANSPORT_TXQ_LEN	8	/* iovecs queued at most */
+
+/* Room for an event and whatever the controller sends right behind it */
+#define URING_RX_LEN		(2 * TRANSPORT_PKT_LEN)
+
+typedef struct transport transport_t;
+
+typedef struct {
+	const char *name;
+	int hci_proto;		/* HCIUARTSETPROTO value, -1: can't attach */
+	int raw;		/* delivers unframed bytes (minidriver ack) */
+	/* Set the link up on tp->fd, returns 0 or -1 */
+	int (*open)(transport_t *tp);
+	/* Change the line speed (a termios B* value) */
+	void (*speed)(transport_t *tp, int speed);
+	/* Queue an H4 packet in n pieces, which must stay valid until flushed */
+	int (*send)(transport_t *tp, const struct iovec *iov, int n);
+	/* Write what is queued: 1 when all of it is out, 0 not yet, -1 */
+	int (*flush)(transport_t *tp);
+	/*
+	 * Receive into pkt (*len bytes of it so far) an H4 event, or need
+	 * raw bytes when need is not 0.  Returns 1 once complete, 0 when
+	 * nothing more can be read now, -1 on errors.
+	 */
+	int (*recv)(transport_t *tp, unsigned char *pkt, int *len, int need);
+	/* poll() events the transport itself needs */
+	int (*events)(const transport_t *tp);
+	/* Milliseconds until the transport needs a flush, -1 for never */
+	int (*timeout)(const transport_t *tp);
+	/* Release what open set up, may be NULL */
+	void (*close)(transport_t *tp);
+	/*
+	 * For hosts that block: wait at most ms (-1: no limit) for something
+	 * to handle, returns poll() style revents, 0 on timeout or -1.  NULL
+	 * when polling poll_fd does just as well.
+	 */
+	int (*wait)(transport_t *tp, int ms);
+} transport_ops_t;
+
+typedef struct {
+	int low_latency;		/* tune the UART for event latency */
+	int type;			/* PORT_* of the driver, -1: unknown */
+	int xmit_fifo_size;
+	int baud_base;
+	int async_low_latency;		/* the driver's low_latency flag */
+	int rx_trig_bytes;		/* RX FIFO trigger level, -1: unknown */
+} transport_serial_t;
+
+typedef struct {
+	struct iovec iov[TRANSPORT_TXQ_LEN];
+	int head;			/* first iovec not fully written */
+	int count;
+	unsigned long queued;		/* bytes ever queued */
+	unsigned long drained;		/* of which written */
+	unsigned int writes;		/* writev() calls that wrote */
+	unsigned int short_writes;	/* that stopped inside the queue */
+} transport_txq_t;
+
+typedef struct {
+	int state;
+	int window;			/* negotiated sliding window */
+	int win_seq;			/* oldest unacknowledged sequence */
+	int nwin;			/* packets in the window */
+	int nsent;			/* of which transmitted */
+	int rx_seq;			/* next sequence expected from peer */
+	int ack_pending;
+	unsigned char win[H5_TX_WIN][TRANSPORT_PKT_LEN];
+	int win_len[H5_TX_WIN];
+	unsigned char out[H5_OUT_LEN];	/* SLIP encoded frames to write */
+	int out_len;
+	int out_queued;			/* handed to the txq so far */
+	unsigned char in[H5_IN_LEN];	/* frame being decoded */
+	int in_len;
+	int in_esc;
+	unsigned char raw[256];		/* bytes read, not decoded yet */
+	int raw_len;
+	int raw_off;
+	struct timespec timer;		/* sync, config or retransmission */
+	unsigned int retransmits;
+} transport_h5_t;
+
+typedef struct {
+	int fd;				/* the ring, -1 when not set up */
+	const transport_ops_t *lower;	/* tty or socket setup */
+	void *sq_ring;
+	void *cq_ring;
+	void *sqes;
+	size_t sq_ring_len;
+	size_t cq_ring_len;
+	size_t sqes_len;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	void *cqes;
+	int queued;			/* SQEs not submitted yet */
+	int fixed;			/* tx and rx are registered */
+	int ext_arg;			/* io_uring_enter() takes a timeout */
+	struct iovec iov[2];
+	unsigned char tx[TRANSPORT_PKT_LEN];
+	int tx_len;
+	int tx_off;
+	int writing;			/* a write is in flight */
+	unsigned char rx[URING_RX_LEN];	/* bytes read, not delivered yet */
+	int rx_len;
+	int rx_off;
+	int reading;			/* a read is in flight */
+	int error;			/* from a completion, for the next call */
+	unsigned int enters;		/* io_uring_enter() calls */
+} transport_uring_t;
+
+struct transport {
+	const transport_ops_t *ops;
+	int fd;
+	int poll_fd;			/* what the host polls: fd or a ring */
+	int blocking;			/* the host waits with ops->wait */
+	struct termios termios;
+	transport_serial_t serial;
+	transport_txq_t txq;
+	transport_h5_t h5;
+	transport_uring_t uring;
+};
+
+extern const transport_ops_t transport_h4;
+extern const transport_ops_t transport_h5;
+extern const transport_ops_t transport_socket;
+extern const transport_ops_t transport_uring;
+
+/* Transport by name ("h4", "h5" or "socket"), NULL if there is none */
+extern const transport_ops_t *transport_find(const char *name);
+
+/* Connect to a controller emulator listening on a Unix socket */
+extern int transport_connect(const char *path);
+
+/*
+ * Set up an io_uring to carry lower, an H4 framed transport, on tp->fd;
+ * tp->ops then becomes transport_uring.  Returns -1 with errno set when
+ * the kernel (or the build) has no io_uring, ENOSYS, EPERM and the like.
+ */
+extern int transport_uring_setup(transport_t *tp, const transport_ops_t *lower);
+
+/*
+ * Queue the n pieces of a packet for writing, all of them or, when the
+ * queue is full, none (-1 with EAGAIN).  Flushing returns 1 once all of
+ * it is written, 0 when the fd would block and -1 on errors.
+ */
+extern void transport_txq_reset(transport_txq_t *q);
+extern int transport_txq_add(transport_txq_t *q, const struct iovec *iov,
+	int n);
+extern int transport_txq_flush(transport_txq_t *q, int fd);
+extern int transport_txq_empty(const transport_txq_t *q);
+
+/*
+ * Helpers shared by the backends.  transport_tty_open() puts the UART in
+ * raw mode at 115200 with a single tcsetattr(), with RTS/CTS flow control
+ * only when flow is set (H5's three-wire link has no such lines), and, if
+ * serial.low_latency is set, also sets the driver's low_latency flag and
+ * the lowest RX FIFO trigger level, logging what the driver offers.
+ */
+extern int transport_tty_open(transport_t *tp, int flow);
+extern void transport_tty_speed(transport_t *tp, int speed);
+extern void transport_arm(struct timespec *ts, long ms);
+extern long transport_ms_left(const struct timespec *ts);
+
+#endif
@@ -0,0 +1,427 @@
+/*****************************************************************************
+**
+**  Name:          transport_h5.c
+**
+**  Description:   Three-wire UART transport (H5).
+**
+**                 Packets are SLIP framed behind a 4 byte header carrying
+**                 a 3 bit sequence and acknowledgement number.  The link
+**                 is set up with SYNC/CONFIG exchanges; after that, HCI
+**                 commands go out as reliable packets that stay in the
+**                 sliding window until the peer acknowledges them and are
+**                 sent again when that takes too long.  The optional data
+**                 integrity check is not asked for; packets carrying one
+**                 anyway have it stripped.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "transport.h"
+
+extern void log2file(const char *fmt, ...);
+
+#define H5_UNINIT		0	/* sending SYNC */
+#define H5_INIT			1	/* sending CONFIG */
+#define H5_ACTIVE		2
+
+#define H5_ACK_PKT		0x00
+#define H5_HCI_CMD		0x01
+#define H5_HCI_EVT		0x04
+#define H5_LINK_CTL		0x0f
+
+#define H5_SYNC_MS		100
+#define H5_RESEND_MS		250
+
+#define SLIP_DELIMITER		0xc0
+#define SLIP_ESC		0xdb
+#define SLIP_ESC_DELIM		0xdc
+#define SLIP_ESC_ESC		0xdd
+
+/* Sliding window size in the low bits, no flow control nor CRC, v1.0 */
+#define H5_CONFIG		H5_TX_WIN
+
+static const unsigned char h5_sync[] = { 0x01, 0x7e };
+static const unsigned char h5_sync_rsp[] = { 0x02, 0x7d };
+static const unsigned char h5_conf[] = { 0x03, 0xfc, H5_CONFIG };
+static const unsigned char h5_conf_rsp[] = { 0x04, 0x7b, H5_CONFIG };
+
+static void
+h5_slip(transport_h5_t *h5, const unsigned char *p, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		switch (p[i]) {
+		case SLIP_DELIMITER:
+			h5->out[h5->out_len++] = SLIP_ESC;
+			h5->out[h5->out_len++] = SLIP_ESC_DELIM;
+			break;
+		case SLIP_ESC:
+			h5->out[h5->out_len++] = SLIP_ESC;
+			h5->out[h5->out_len++] = SLIP_ESC_ESC;
+			break;
+		default:
+			h5->out[h5->out_len++] = p[i];
+			break;
+		}
+	}
+}
+
+/* Queue one frame for writing, returns -1 when there is no room yet */
+static int
+h5_frame(transport_h5_t *h5, int type, int seq, const unsigned char *data,
+	int len)
+{
+	unsigned char hdr[4];
+
+	/* Worst case every byte is escaped */
+	if (h5->out_len + 2 * (4 + len) + 2 > H5_OUT_LEN) {
+		return(-1);
+	}
+
+	hdr[0] = h5->rx_seq << 3;
+	if (seq >= 0) {
+		hdr[0] |= 0x80 | seq;
+	}
+	hdr[1] = type | (len & 0x0f) << 4;
+	hdr[2] = len >> 4;
+	hdr[3] = ~(hdr[0] + hdr[1] + hdr[2]);
+
+	h5->out[h5->out_len++] = SLIP_DELIMITER;
+	h5_slip(h5, hdr, sizeof(hdr));
+	h5_slip(h5, data, len);
+	h5->out[h5->out_len++] = SLIP_DELIMITER;
+
+	/* Every header acknowledges what was received so far */
+	h5->ack_pending = 0;
+
+	return(0);
+}
+
+static void
+h5_reset(transport_h5_t *h5)
+{
+	h5->state = H5_UNINIT;
+	h5->window = 1;
+	h5->win_seq = 0;
+	h5->nwin = 0;
+	h5->nsent = 0;
+	h5->rx_seq = 0;
+	h5->ack_pending = 0;
+	h5->in_len = -1;
+	h5->in_esc = 0;
+	h5->timer.tv_sec = 0;
+}
+
+static int
+h5_open(transport_t *tp)
+{
+	transport_h5_t *h5 = &tp->h5;
+
+	h5_reset(h5);
+	h5->out_len = 0;
+	h5->out_queued = 0;
+	h5->raw_len = 0;
+	h5->raw_off = 0;
+	h5->retransmits = 0;
+
+	/* Three wires, no RTS/CTS: flow control would stall transmit */
+	return(transport_tty_open(tp, 0));
+}
+
+static int
+h5_send(transport_t *tp, const struct iovec *iov, int n)
+{
+	transport_h5_t *h5 = &tp->h5;
+	int i, slot, len = 0;
+
+	for (i = 0; i < n; i++) {
+		len += iov[i].iov_len;
+	}
+
+	if (h5->nwin == H5_TX_WIN || len > TRANSPORT_PKT_LEN) {
+		errno = EAGAIN;
+		return(-1);
+	}
+
+	/* The H4 type byte becomes the H5 packet type */
+	slot = (h5->win_seq + h5->nwin) % H5_TX_WIN;
+	h5->win_len[slot] = 0;
+	for (i = 0; i < n; i++) {
+		memcpy(h5->win[slot] + h5->win_len[slot], iov[i].iov_base,
+			iov[i].iov_len);
+		h5->win_len[slot] += iov[i].iov_len;
+	}
+	h5->nwin++;
+
+	return(0);
+}
+
+static int
+h5_expired(const transport_h5_t *h5)
+{
+	return(h5->timer.tv_sec != 0 && transport_ms_left(&h5->timer) == 0);
+}
+
+static void
+h5_queue(transport_h5_t *h5)
+{
+	const unsigned char *pkt;
+	int seq, slot;
+
+	if (h5->state != H5_ACTIVE) {
+		if (h5->timer.tv_sec == 0 || h5_expired(h5)) {
+			if (h5->state == H5_UNINIT) {
+				h5_frame(h5, H5_LINK_CTL, -1, h5_sync,
+					sizeof(h5_sync));
+			} else {
+				h5_frame(h5, H5_LINK_CTL, -1, h5_conf,
+					sizeof(h5_conf));
+			}
+			transport_arm(&h5->timer, H5_SYNC_MS);
+		}
+		return;
+	}
+
+	/* Nothing acknowledged in time, go back and send the window again */
+	if (h5->nsent > 0 && h5_expired(h5)) {
+		h5->retransmits += h5->nsent;
+		h5->nsent = 0;
+	}
+
+	while (h5->nsent < h5->nwin && h5->nsent < h5->window) {
+		seq = (h5->win_seq + h5->nsent) & 0x07;
+		slot = (h5->win_seq + h5->nsent) % H5_TX_WIN;
+		pkt = h5->win[slot];
+
+		if (h5_frame(h5, pkt[0], seq, pkt + 1, h5->win_len[slot] - 1)
+				< 0) {
+			break;
+		}
+
+		h5->nsent++;
+		transport_arm(&h5->timer, H5_RESEND_MS);
+	}
+
+	if (h5->ack_pending) {
+		h5_frame(h5, H5_ACK_PKT, -1, NULL, 0);
+	}
+}
+
+static int
+h5_flush(transport_t *tp)
+{
+	transport_h5_t *h5 = &tp->h5;
+	struct iovec iov;
+	int ret;
+
+	h5_queue(h5);
+
+	/* Frames are only appended to out until all of it is written */
+	do {
+		if (h5->out_queued < h5->out_len) {
+			iov.iov_base = h5->out + h5->out_queued;
+			iov.iov_len = h5->out_len - h5->out_queued;
+			if (transport_txq_add(&tp->txq, &iov, 1) == 0) {
+				h5->out_queued = h5->out_len;
+			}
+		}
+
+		if ((ret = transport_txq_flush(&tp->txq, tp->fd)) <= 0) {
+			return(ret);
+		}
+	} while (h5->out_queued < h5->out_len);
+
+	h5->out_len = 0;
+	h5->out_queued = 0;
+
+	return(h5->state == H5_ACTIVE && h5->nsent == h5->nwin);
+}
+
+/* The peer acknowledged everything before sequence number ack */
+static void
+h5_acked(transport_h5_t *h5, int ack)
+{
+	while (h5->nsent > 0 && h5->win_seq != ack) {
+		h5->win_seq = (h5->win_seq + 1) & 0x07;
+		h5->nwin--;
+		h5->nsent--;
+	}
+
+	if (h5->nsent == 0) {
+		h5->timer.tv_sec = 0;
+	}
+}
+
+static void
+h5_link_control(transport_h5_t *h5, const unsigned char *p, int len)
+{
+	if (len < 2) {
+		return;
+	}
+
+	if (memcmp(p, h5_sync, 2) == 0) {
+		/* A SYNC on an active link means the peer restarted */
+		if (h5->state == H5_ACTIVE) {
+			log2file("H5 peer reset\n");
+			h5_reset(h5);
+		}
+		h5_frame(h5, H5_LINK_CTL, -1, h5_sync_rsp, sizeof(h5_sync_rsp));
+	} else if (memcmp(p, h5_sync_rsp, 2) == 0) {
+		if (h5->state == H5_UNINIT) {
+			h5->state = H5_INIT;
+			h5->timer.tv_sec = 0;
+		}
+	} else if (memcmp(p, h5_conf, 2) == 0) {
+		h5_frame(h5, H5_LINK_CTL, -1, h5_conf_rsp, sizeof(h5_conf_rsp));
+	} else if (memcmp(p, h5_conf_rsp, 2) == 0) {
+		if (h5->state == H5_INIT) {
+			h5->window = len > 2 ? p[2] & 0x07 : 1;
+			if (h5->window == 0 || h5->window > H5_TX_WIN) {
+				h5->window = h5->window ? H5_TX_WIN : 1;
+			}
+			h5->state = H5_ACTIVE;
+			h5->timer.tv_sec = 0;
+		}
+	}
+}
+
+/* Handle a complete frame, returns 1 if it was an event for the caller */
+static int
+h5_frame_in(transport_h5_t *h5, unsigned char *pkt, int *len)
+{
+	const unsigned char *hdr = h5->in;
+	int plen, seq, ack, type;
+
+	if (h5->in_len < 4
+			|| ((hdr[0] + hdr[1] + hdr[2] + hdr[3]) & 0xff) != 0xff) {
+		return(0);
+	}
+
+	seq = hdr[0] & 0x07;
+	ack = hdr[0] >> 3 & 0x07;
+	type = hdr[1] & 0x0f;
+	plen = hdr[1] >> 4 | hdr[2] << 4;
+
+	if (4 + plen + (hdr[0] & 0x40 ? 2 : 0) != h5->in_len
+			|| plen > TRANSPORT_PKT_LEN - 1) {
+		return(0);
+	}
+
+	if (h5->state == H5_ACTIVE) {
+		h5_acked(h5, ack);
+	}
+
+	if (hdr[0] & 0x80) {
+		/* Acknowledge even duplicates, our ack may have been lost */
+		h5->ack_pending = 1;
+
+		if (seq != h5->rx_seq) {
+			return(0);
+		}
+
+		h5->rx_seq = (h5->rx_seq + 1) & 0x07;
+	}
+
+	switch (type) {
+	case H5_LINK_CTL:
+		h5_link_control(h5, hdr + 4, plen);
+		break;
+	case H5_HCI_EVT:
+		pkt[0] = H5_HCI_EVT;
+		memcpy(pkt + 1, hdr + 4, plen);
+		*len = 1 + plen;
+		return(1);
+	}
+
+	return(0);
+}
+
+static int
+h5_recv(transport_t *tp, unsigned char *pkt, int *len, int need)
+{
+	transport_h5_t *h5 = &tp->h5;
+	unsigned char c;
+	ssize_t n;
+
+	while (1) {
+		if (h5->raw_off == h5->raw_len) {
+			n = read(tp->fd, h5->raw, sizeof(h5->raw));
+
+			if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+				return(0);
+			}
+
+			if (n <= 0) {
+				if (n == 0) {
+					errno = EPIPE;
+				}
+				return(-1);
+			}
+
+			h5->raw_len = n;
+			h5->raw_off = 0;
+		}
+
+		c = h5->raw[h5->raw_off++];
+
+		if (c == SLIP_DELIMITER) {
+			/* in_len is -1 until the first delimiter is seen */
+			if (h5->in_len > 0 && h5_frame_in(h5, pkt, len)) {
+				h5->in_len = 0;
+				return(1);
+			}
+			h5->in_len = 0;
+			h5->in_esc = 0;
+			continue;
+		}
+
+		if (h5->in_len < 0) {
+			continue;
+		}
+
+		if (h5->in_esc) {
+			h5->in_esc = 0;
+			c = c == SLIP_ESC_DELIM ? SLIP_DELIMITER : SLIP_ESC;
+		} else if (c == SLIP_ESC) {
+			h5->in_esc = 1;
+			continue;
+		}
+
+		if (h5->in_len == H5_IN_LEN) {
+			/* Garbage, wait for the next delimiter */
+			h5->in_len = -1;
+			continue;
+		}
+
+		h5->in[h5->in_len++] = c;
+	}
+}
+
+static int
+h5_events(const transport_t *tp)
+{
+	/* Link establishment and acknowledgements need reading anyway */
+	return(POLLIN | (transport_txq_empty(&tp->txq) ? 0 : POLLOUT));
+}
+
+static int
+h5_timeout(const transport_t *tp)
+{
+	if (tp->h5.timer.tv_sec == 0) {
+		return(-1);
+	}
+
+	return(transport_ms_left(&tp->h5.timer));
+}
+
+const transport_ops_t transport_h5 = {
+	"h5", HCI_UART_3WIRE, 0,
+	h5_open, transport_tty_speed,
+	h5_send, h5_flush, h5_recv, h5_events, h5_timeout
+};
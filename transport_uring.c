@@ -0,0 +1,611 @@
+/*****************************************************************************
+**
+**  Name:          transport_uring.c
+**
+**  Description:   H4 framing over io_uring.
+**
+**                 Each command is submitted as a write linked to a read
+**                 of the controller's answer.  A blocking host submits
+**                 them and waits for both in one io_uring_enter(), which
+**                 replaces the write(), poll() and reads each record took;
+**                 an event loop host polls the ring instead.
+**
+**                 The packet and receive buffers are registered with the
+**                 ring and used with WRITE_FIXED and READ_FIXED; records
+**                 are staged into the packet buffer since they go out
+**                 behind an H4 type byte and may come from a decompressing
+**                 stream rather than a mapping.  A read asks for all the
+**                 room left, so the two byte minidriver acknowledgement
+**                 arriving behind an event is kept for the next recv.
+**
+**                 The ring is set up with the raw system calls; no
+**                 liburing is needed.  Build with IO_URING=1.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "transport.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES		8
+
+#define URING_WRITE		1	/* user_data of the completions */
+#define URING_READ		2
+
+/* Submit what is queued and wait for nwait completions */
+static int
+uring_enter(transport_uring_t *u, int nwait, unsigned int flags, void *arg,
+	size_t argsz)
+{
+	int n;
+
+	if (u->queued == 0 && nwait == 0) {
+		return(0);
+	}
+
+	if (nwait) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+
+	do {
+		n = syscall(__NR_io_uring_enter, u->fd, u->queued, nwait, flags,
+			arg, argsz);
+	} while (n < 0 && errno == EINTR);
+
+	u->enters++;
+
+	if (n < 0) {
+		return(-1);
+	}
+
+	u->queued -= n;
+
+	return(0);
+}
+
+static int
+uring_ready(const transport_uring_t *u)
+{
+	return(*u->cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE));
+}
+
+static struct io_uring_sqe *
+uring_sqe(transport_uring_t *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *u->sq_tail;
+	unsigned int idx = tail & *u->sq_mask;
+
+	sqe = (struct io_uring_sqe *)u->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+
+	return(sqe);
+}
+
+static void
+uring_prep(transport_uring_t *u, struct io_uring_sqe *sqe, int fd, int write,
+	unsigned char *buf, int len)
+{
+	int idx = write ? 0 : 1;
+
+	sqe->fd = fd;
+	sqe->user_data = write ? URING_WRITE : URING_READ;
+
+	if (u->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = len;
+		sqe->buf_index = idx;
+	} else {
+		/* Vectored, the oldest operations a ring has */
+		u->iov[idx].iov_base = buf;
+		u->iov[idx].iov_len = len;
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (unsigned long)&u->iov[idx];
+		sqe->len = 1;
+	}
+}
+
+static void
+uring_queue_read(transport_t *tp, struct io_uring_sqe *sqe)
+{
+	transport_uring_t *u = &tp->uring;
+
+	/* Nothing reads into rx now, so what is left can move up front */
+	if (u->rx_off == u->rx_len) {
+		u->rx_off = 0;
+		u->rx_len = 0;
+	} else if (u->rx_off > 0) {
+		memmove(u->rx, u->rx + u->rx_off, u->rx_len - u->rx_off);
+		u->rx_len -= u->rx_off;
+		u->rx_off = 0;
+	}
+
+	uring_prep(u, sqe, tp->fd, 0, u->rx + u->rx_len,
+		URING_RX_LEN - u->rx_len);
+	u->reading = 1;
+}
+
+/* Take in whatever completed, errors are kept for the caller */
+static void
+uring_reap(transport_t *tp)
+{
+	transport_uring_t *u = &tp->uring;
+	struct io_uring_cqe *cqe;
+	unsigned int head = *u->cq_head;
+	int res;
+
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = (struct io_uring_cqe *)u->cqes + (head & *u->cq_mask);
+		res = cqe->res;
+
+		if (cqe->user_data == URING_WRITE) {
+			u->writing = 0;
+			if (res >= 0) {
+				u->tx_off += res;
+				tp->txq.writes++;
+				tp->txq.drained += res;
+				if (u->tx_off < u->tx_len) {
+					tp->txq.short_writes++;
+				}
+			}
+		} else {
+			u->reading = 0;
+			if (res > 0) {
+				u->rx_len += res;
+			} else if (res == 0) {
+				res = -EPIPE;
+			}
+		}
+
+		/* A short write cancels the read linked to it, both come back */
+		if (res < 0 && res != -EAGAIN && res != -EINTR
+				&& res != -ECANCELED && u->error == 0) {
+			u->error = -res;
+		}
+
+		head++;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int
+uring_open(transport_t *tp)
+{
+	transport_uring_t *u = &tp->uring;
+	int flags;
+
+	u->tx_len = 0;
+	u->tx_off = 0;
+	u->writing = 0;
+	u->rx_len = 0;
+	u->rx_off = 0;
+	u->reading = 0;
+	u->error = 0;
+	u->enters = 0;
+
+	if (u->lower->open(tp) < 0) {
+		return(-1);
+	}
+
+	/*
+	 * On a non-blocking file a request fails with EAGAIN instead of
+	 * waiting in the ring for the UART to become ready.
+	 */
+	if ((flags = fcntl(tp->fd, F_GETFL)) < 0
+			|| fcntl(tp->fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		return(-1);
+	}
+
+	tp->poll_fd = u->fd;
+
+	return(0);
+}
+
+static void
+uring_speed(transport_t *tp, int speed)
+{
+	tp->uring.lower->speed(tp, speed);
+}
+
+static int
+uring_send(transport_t *tp, const struct iovec *iov, int n)
+{
+	transport_uring_t *u = &tp->uring;
+	int i, len = 0;
+
+	uring_reap(tp);
+
+	for (i = 0; i < n; i++) {
+		len += iov[i].iov_len;
+	}
+
+	if (u->writing || len > TRANSPORT_PKT_LEN) {
+		errno = EAGAIN;
+		return(-1);
+	}
+
+	u->tx_len = 0;
+	for (i = 0; i < n; i++) {
+		memcpy(u->tx + u->tx_len, iov[i].iov_base, iov[i].iov_len);
+		u->tx_len += iov[i].iov_len;
+	}
+	u->tx_off = 0;
+	tp->txq.queued += len;
+
+	return(0);
+}
+
+static int
+uring_flush(transport_t *tp)
+{
+	transport_uring_t *u = &tp->uring;
+	struct io_uring_sqe *sqe;
+
+	uring_reap(tp);
+
+	if (u->error) {
+		errno = u->error;
+		return(-1);
+	}
+
+	if (u->tx_off == u->tx_len) {
+		return(1);
+	}
+
+	if (!u->writing) {
+		sqe = uring_sqe(u);
+		uring_prep(u, sqe, tp->fd, 1, u->tx + u->tx_off,
+			u->tx_len - u->tx_off);
+		u->writing = 1;
+
+		/* The answer is read as soon as the command is out */
+		if (!u->reading) {
+			sqe->flags |= IOSQE_IO_LINK;
+			uring_queue_read(tp, uring_sqe(u));
+		}
+
+		/* A blocking host submits and waits with one system call */
+		if (!tp->blocking && uring_enter(u, 0, 0, NULL, 0) < 0) {
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+/* Deliver an event or raw bytes from what was read, like h4_recv() */
+static int
+uring_recv(transport_t *tp, unsigned char *pkt, int *len, int need)
+{
+	transport_uring_t *u = &tp->uring;
+	int want, n;
+
+	uring_reap(tp);
+
+	while (1) {
+		if (need) {
+			want = need;
+		} else if (*len < 3) {
+			want = 3;
+		} else {
+			want = 3 + pkt[2];
+		}
+
+		if (*len == want) {
+			return(1);
+		}
+
+		if (u->rx_off == u->rx_len) {
+			break;
+		}
+
+		n = want - *len;
+		if (n > u->rx_len - u->rx_off) {
+			n = u->rx_len - u->rx_off;
+		}
+
+		memcpy(pkt + *len, u->rx + u->rx_off, n);
+		u->rx_off += n;
+		*len += n;
+	}
+
+	if (u->error) {
+		errno = u->error;
+		return(-1);
+	}
+
+	if (!u->reading) {
+		uring_queue_read(tp, uring_sqe(u));
+
+		if (!tp->blocking && uring_enter(u, 0, 0, NULL, 0) < 0) {
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+/* Completions make the ring readable, which the exchange always polls */
+static int
+uring_events(const transport_t *tp)
+{
+	return(0);
+}
+
+static int
+uring_timeout(const transport_t *tp)
+{
+	return(-1);
+}
+
+/*
+ * Submit and wait for everything in flight: a command and its answer come
+ * back together, and only steps waiting for time have a timeout.
+ */
+static int
+uring_wait(transport_t *tp, int ms)
+{
+	transport_uring_t *u = &tp->uring;
+	int nwait = u->writing + u->reading;
+	struct pollfd p;
+#ifdef IORING_FEAT_EXT_ARG
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+#endif
+
+	/* Ready, or nothing to wait for until recv queues a read */
+	if (uring_ready(u) || nwait == 0) {
+		if (uring_enter(u, 0, 0, NULL, 0) < 0) {
+			return(-1);
+		}
+		return(POLLIN);
+	}
+
+	if (ms < 0) {
+		if (uring_enter(u, nwait, 0, NULL, 0) < 0) {
+			return(-1);
+		}
+		return(POLLIN);
+	}
+
+#ifdef IORING_FEAT_EXT_ARG
+	if (u->ext_arg && ms > 0) {
+		memset(&arg, 0, sizeof(arg));
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000L;
+		arg.ts = (unsigned long)&ts;
+
+		if (uring_enter(u, nwait, IORING_ENTER_EXT_ARG, &arg,
+				sizeof(arg)) < 0 && errno != ETIME) {
+			return(-1);
+		}
+		return(uring_ready(u) ? POLLIN : 0);
+	}
+#endif
+
+	/* Kernels before 5.11 take no timeout, poll the ring for it */
+	if (uring_enter(u, 0, 0, NULL, 0) < 0) {
+		return(-1);
+	}
+
+	p.fd = u->fd;
+	p.events = POLLIN;
+	p.revents = 0;
+
+	if (!uring_ready(u) && poll(&p, 1, ms) < 0) {
+		return(errno == EINTR ? 0 : -1);
+	}
+
+	return(uring_ready(u) ? POLLIN : 0);
+}
+
+static void
+uring_close(transport_t *tp)
+{
+	transport_uring_t *u = &tp->uring;
+
+	if (u->fd < 0) {
+		return;
+	}
+
+	/* Closing the ring cancels the read still waiting for the UART */
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_len);
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_ring_len);
+	}
+	if (u->sq_ring) {
+		munmap(u->sq_ring, u->sq_ring_len);
+	}
+	close(u->fd);
+
+	u->fd = -1;
+	u->sq_ring = NULL;
+	u->cq_ring = NULL;
+	u->sqes = NULL;
+	tp->poll_fd = tp->fd;
+}
+
+int
+transport_uring_setup(transport_t *tp, const transport_ops_t *lower)
+{
+	transport_uring_t *u = &tp->uring;
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+
+	u->fd = -1;
+	u->sq_ring = NULL;
+	u->cq_ring = NULL;
+	u->sqes = NULL;
+	u->queued = 0;
+	u->lower = lower;
+
+	memset(&p, 0, sizeof(p));
+
+	if ((u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+		u->fd = -1;
+		return(-1);
+	}
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_len = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_len > u->sq_ring_len) {
+			u->sq_ring_len = u->cq_ring_len;
+		}
+		u->cq_ring_len = u->sq_ring_len;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			goto fail;
+		}
+	}
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto fail;
+	}
+
+	sq = u->sq_ring;
+	cq = u->cq_ring;
+	u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes = cq + p.cq_off.cqes;
+
+	/* Without registered buffers (locked memory limit) plain vectors do */
+	u->iov[0].iov_base = u->tx;
+	u->iov[0].iov_len = sizeof(u->tx);
+	u->iov[1].iov_base = u->rx;
+	u->iov[1].iov_len = sizeof(u->rx);
+	u->fixed = syscall(__NR_io_uring_register, u->fd,
+		IORING_REGISTER_BUFFERS, u->iov, 2) == 0;
+#ifdef IORING_FEAT_EXT_ARG
+	u->ext_arg = (p.features & IORING_FEAT_EXT_ARG) != 0;
+#else
+	u->ext_arg = 0;
+#endif
+
+	tp->ops = &transport_uring;
+
+	return(0);
+
+fail:
+	transport_uring.close(tp);
+	return(-1);
+}
+
+#else
+
+static int
+uring_open(transport_t *tp)
+{
+	errno = ENOSYS;
+	return(-1);
+}
+
+static void
+uring_speed(transport_t *tp, int speed)
+{
+}
+
+static int
+uring_send(transport_t *tp, const struct iovec *iov, int n)
+{
+	errno = ENOSYS;
+	return(-1);
+}
+
+static int
+uring_flush(transport_t *tp)
+{
+	errno = ENOSYS;
+	return(-1);
+}
+
+static int
+uring_recv(transport_t *tp, unsigned char *pkt, int *len, int need)
+{
+	errno = ENOSYS;
+	return(-1);
+}
+
+static int
+uring_events(const transport_t *tp)
+{
+	return(0);
+}
+
+static int
+uring_timeout(const transport_t *tp)
+{
+	return(-1);
+}
+
+static void
+uring_close(transport_t *tp)
+{
+}
+
+static int
+uring_wait(transport_t *tp, int ms)
+{
+	errno = ENOSYS;
+	return(-1);
+}
+
+/* Built without io_uring, the poll() path is all there is */
+int
+transport_uring_setup(transport_t *tp, const transport_ops_t *lower)
+{
+	errno = ENOSYS;
+	return(-1);
+}
+
+#endif
+
+const transport_ops_t transport_uring = {
+	"io_uring", HCI_UART_H4, 1,
+	uring_open, uring_speed,
+	uring_send, uring_flush, uring_recv, uring_events, uring_timeout,
+	uring_close, uring_wait
+};